@@ -0,0 +1,83 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 8
+
+struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    uint8_t data[];
+};
+
+void arena_init(struct Arena *const arena, size_t block_size)
+{
+    arena->head = NULL;
+    arena->block_size = block_size;
+}
+
+void *arena_alloc(struct Arena *const arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    struct ArenaBlock *block = arena->head;
+    if (block == NULL || block->size - block->used < size) {
+        // Oversized allocations get a block of their own
+        size_t block_size = arena->block_size;
+        if (block_size < size) {
+            block_size = size;
+        }
+        block = malloc(sizeof(*block) + block_size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->used = 0;
+        block->size = block_size;
+        block->next = arena->head;
+        arena->head = block;
+    }
+    void *p = block->data + block->used;
+    block->used += size;
+    return p;
+}
+
+char *arena_strndup(struct Arena *const arena, const char *src, size_t count)
+{
+    char *dest = arena_alloc(arena, count + 1);
+    if (dest == NULL) {
+        return NULL;
+    }
+    memcpy(dest, src, count);
+    dest[count] = '\0';
+    return dest;
+}
+
+void arena_reset(struct Arena *const arena)
+{
+    // Keep the most recent block around for reuse, it is the one that was big enough last time
+    struct ArenaBlock *block = arena->head;
+    if (block == NULL) {
+        return;
+    }
+    struct ArenaBlock *next = block->next;
+    while (next != NULL) {
+        struct ArenaBlock *tmp = next->next;
+        free(next);
+        next = tmp;
+    }
+    block->next = NULL;
+    block->used = 0;
+}
+
+void arena_free(struct Arena *const arena)
+{
+    struct ArenaBlock *block = arena->head;
+    while (block != NULL) {
+        struct ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+}
@@ -0,0 +1,31 @@
+#ifndef COVENANTSQL_ARENA_H
+#define COVENANTSQL_ARENA_H
+
+#include <stddef.h>
+
+/*
+** Make sure we can call this stuff from C++.
+*/
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ArenaBlock;
+
+// A bump allocator: allocations are carved out of large blocks and released all together by
+// arena_reset or arena_free, there is no way to free a single allocation.
+struct Arena {
+    struct ArenaBlock *head;
+    size_t block_size;
+};
+
+void arena_init(struct Arena *const arena, size_t block_size);
+void *arena_alloc(struct Arena *const arena, size_t size);
+char *arena_strndup(struct Arena *const arena, const char *src, size_t count);
+void arena_reset(struct Arena *const arena);
+void arena_free(struct Arena *const arena);
+
+#ifdef __cplusplus
+}  /* End of the 'extern "C"' block */
+#endif
+#endif /* COVENANTSQL_ARENA_H */
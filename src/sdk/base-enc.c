@@ -156,6 +156,30 @@ int decode_string(struct Buffer *const src, char **dest)
     return 0;
 }
 
+void encode_bytes(struct Buffer *const dest, const void *src, size_t count)
+{
+    encode_uint32(dest, (uint32_t)count);
+    buffer_write(dest, src, count);
+}
+
+// Decode a string or blob as a view into src, see buffer_view for how long it stays valid. The
+// bytes of a string view are not NUL-terminated.
+int decode_bytes_view(struct Buffer *const src, const void **dest, size_t *count)
+{
+    int rc;
+    uint32_t dcount;
+    rc = decode_uint32(src, &dcount);
+    if (rc != 0) {
+        return rc;
+    }
+    rc = buffer_view(src, dest, (size_t)dcount);
+    if (rc != 0) {
+        return rc;
+    }
+    *count = (size_t)dcount;
+    return 0;
+}
+
 void encode_blob(struct Buffer *const dest, const struct Blob *src)
 {
     encode_uint32(dest, (uint32_t)src->count);
@@ -212,3 +236,16 @@ int decode_double_pointer(struct Buffer *const src, double **value)
 {
     return decode_uint64_pointer(src, (uint64_t **)value);
 }
+
+uint32_t checksum_crc32(const void *src, size_t count)
+{
+    const uint8_t *p = (const uint8_t *)src;
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < count; i++) {
+        crc ^= p[i];
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
@@ -26,6 +26,8 @@ int decode_uint64(struct Buffer *const src, uint64_t *const value);
 int decode_uint64_pointer(struct Buffer *const src, uint64_t **value);
 void encode_string(struct Buffer *const dest, const char *src);
 int decode_string(struct Buffer *const src, char **dest);
+void encode_bytes(struct Buffer *const dest, const void *src, size_t count);
+int decode_bytes_view(struct Buffer *const src, const void **dest, size_t *count);
 
 struct Blob {
     size_t count;
@@ -42,6 +44,8 @@ void encode_double(struct Buffer *const dest, double value);
 int decode_double(struct Buffer *const src, double *value);
 int decode_double_pointer(struct Buffer *const src, double **value);
 
+uint32_t checksum_crc32(const void *src, size_t count);
+
 #ifdef __cplusplus
 }  /* End of the 'extern "C"' block */
 #endif
@@ -5,6 +5,8 @@
 #include <string.h>
 
 #include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "buffer.h"
@@ -48,12 +50,23 @@ int buffer_flush(struct Buffer *const src)
     return 0;
 }
 
-int buffer_read(struct Buffer *const src, void *const dest, size_t count)
+// Make sure count bytes are available from read_p, reading pages from fp as needed.
+static int buffer_fill(struct Buffer *const src, size_t count)
 {
-    if (src->read_p > src->offset || src->offset - src->read_p < count) {
-        if (src->fp == NULL) {
-            return -1;
-        }
+    if (src->read_p <= src->offset && src->offset - src->read_p >= count) {
+        return 0;
+    }
+    if (src->fp == NULL) {
+        return -1;
+    }
+    // Drop consumed bytes, so that reading a file does not grow the buffer to its size
+    if (src->read_p > 0 && src->read_p <= src->offset) {
+        memmove(src->buffer, src->buffer+src->read_p, src->offset-src->read_p);
+        src->discarded += src->read_p;
+        src->offset -= src->read_p;
+        src->read_p = 0;
+    }
+    while (src->read_p > src->offset || src->offset - src->read_p < count) {
         // Read page
         buffer_ensure(src, PAGE_SIZE);
         size_t rc = fread(src->buffer+src->offset, 1, PAGE_SIZE, src->fp);
@@ -63,17 +76,80 @@ int buffer_read(struct Buffer *const src, void *const dest, size_t count)
             return -1;
         }
         src->offset += rc;
-        if (src->read_p > src->offset || src->offset - src->read_p < count) {
+        if (rc == 0) {
             // No enough data
             printf("file has no enough data\n");
             return -1;
         }
     }
+    return 0;
+}
+
+int buffer_read(struct Buffer *const src, void *const dest, size_t count)
+{
+    if (buffer_fill(src, count) != 0) {
+        return -1;
+    }
     memcpy(dest, src->buffer+src->read_p, count);
     src->read_p += count;
     return 0;
 }
 
+// Consume count bytes and point *dest at them in place instead of copying them out. The view
+// stays valid as long as a mapped buffer does, but only until the next read for a buffer that
+// reads from fp.
+int buffer_view(struct Buffer *const src, const void **dest, size_t count)
+{
+    if (buffer_fill(src, count) != 0) {
+        return -1;
+    }
+    *dest = src->buffer+src->read_p;
+    src->read_p += count;
+    return 0;
+}
+
+// Map the whole file for reading, so that it is decoded in place without copying it into the
+// buffer page by page. The mapping does not follow later writes to the file.
+int buffer_map(struct Buffer *const buffer, FILE *fp)
+{
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0) {
+        return -1;
+    }
+    buffer->fp = NULL;
+    buffer->read_p = 0;
+    buffer->discarded = 0;
+    if (st.st_size == 0) {
+        buffer->offset = 0;
+        return 0;
+    }
+
+    void *addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    if (addr == MAP_FAILED) {
+        printf("failed to map file: io error\n");
+        return -1;
+    }
+    free(buffer->buffer);
+    buffer->buffer = addr;
+    buffer->offset = (size_t)st.st_size;
+    buffer->size = (size_t)st.st_size;
+    buffer->mapped = 1;
+    return 0;
+}
+
+// Position of the next byte to read, relative to where reading started.
+size_t buffer_position(const struct Buffer *src)
+{
+    return src->discarded + src->read_p;
+}
+
+void buffer_reset(struct Buffer *const buffer)
+{
+    buffer->read_p = 0;
+    buffer->offset = 0;
+    buffer->discarded = 0;
+}
+
 void buffer_init(struct Buffer *const buffer)
 {
     buffer->fp = NULL;
@@ -81,10 +157,16 @@ void buffer_init(struct Buffer *const buffer)
     buffer->read_p = 0;
     buffer->offset = 0;
     buffer->size = 0;
+    buffer->discarded = 0;
+    buffer->mapped = 0;
 }
 
 void buffer_free(struct Buffer *const buffer)
 {
-    free(buffer->buffer);
+    if (buffer->mapped) {
+        munmap(buffer->buffer, buffer->size);
+    } else {
+        free(buffer->buffer);
+    }
     free((void *)buffer);
 }
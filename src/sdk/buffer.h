@@ -18,12 +18,20 @@ struct Buffer {
     size_t read_p;
     size_t offset;
     size_t size;
+    // bytes consumed and dropped from the front of buffer by reads
+    size_t discarded;
+    // buffer is a read-only mapping of a whole file
+    int mapped;
 };
 
 void buffer_ensure(struct Buffer *const dest, size_t count);
 void buffer_write(struct Buffer *const dest, const void *src, size_t count);
 int buffer_flush(struct Buffer *const src);
 int buffer_read(struct Buffer *const src, void *const dest, size_t count);
+int buffer_view(struct Buffer *const src, const void **dest, size_t count);
+int buffer_map(struct Buffer *const buffer, FILE *fp);
+size_t buffer_position(const struct Buffer *src);
+void buffer_reset(struct Buffer *const buffer);
 void buffer_init(struct Buffer *const buffer);
 void buffer_free(struct Buffer *const buffer);
 
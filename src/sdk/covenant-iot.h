@@ -4,6 +4,8 @@
 #include <MQTTClient.h>
 #include <json-c/json.h>
 #include <sqlite3.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /*
 ** Make sure we can call this stuff from C++.
@@ -12,18 +14,115 @@
 extern "C" {
 #endif
 
+// Type of an argument bound to a statement pattern.
+enum Types {
+    Null, String, Int, Float, Blob,
+};
+
+// An argument bound to a statement pattern. Arguments without a name (name == NULL or
+// name_size == 0) are bound to positional parameters in order, named ones to the parameter with
+// the same name, with or without its ":", "@" or "$" prefix. value points to an int64_t for Int,
+// to a double for Float, and to size bytes for String and Blob, which do not need to be
+// NUL-terminated.
+struct Argument {
+    char* name;
+    size_t name_size;
+    void* value;
+    size_t size;
+    enum Types type;
+};
+
 struct LogEntry;
 
 void log_entry_init(struct LogEntry *const log_entry);
 void log_entry_free(struct LogEntry *const log_entry);
 int encode_log_entry_json(struct json_object *const dest, const struct LogEntry *src);
+// Same JSON as encode_log_entry_json serialized with JSON_C_TO_STRING_SPACED, appended to dest
+// without building json-c objects.
+struct Buffer;
+void write_log_entry_json(struct Buffer *const dest, const struct LogEntry *src);
 int decode_log_entry_json(const struct json_object *obj, struct LogEntry **dest);
+int decode_log_envelope_json(const struct json_object *obj, struct LogEntry ***dest, size_t *count);
+
+// How cql_publish encodes the entries it publishes.
+enum PayloadFormat {
+    // an entry or envelope as a JSON object
+    PayloadJson,
+    // entries in the local log encoding, behind a versioned binary header
+    PayloadBinary,
+};
+
+// Reader over the entries of a binary payload, decoded in place. The entry returned by next is
+// owned by the reader and is valid until the following call; it is set to NULL after the last.
+struct PayloadReader;
+
+int log_payload_reader_open(const void *payload, size_t size, struct PayloadReader **dest);
+int log_payload_reader_next(struct PayloadReader *const reader, struct LogEntry **entry);
+void log_payload_reader_close(struct PayloadReader *const reader);
+
+// Compressed payloads, binary or JSON, are marked in their header; decompressing one gives the
+// payload as it would have been published without compression.
+int log_payload_is_compressed(const void *payload, size_t size);
+int log_payload_decompress(const void *payload, size_t size, const void *dictionary,
+                           size_t dictionary_size, void **dest, size_t *dest_size);
+
+// Decoder for entries in JSON, as decode_log_entry_json takes them, that parses the text in a
+// single pass without building json-c objects. The entry returned by decode is owned by the
+// decoder and is valid until the following call; its strings are not NUL-terminated and may
+// point into the payload, which must outlive the entry.
+struct LogJsonDecoder;
+
+int log_json_decoder_open(struct LogJsonDecoder **dest);
+int log_json_decoder_decode(struct LogJsonDecoder *const decoder, const void *payload, size_t size,
+                            struct LogEntry **entry);
+void log_json_decoder_close(struct LogJsonDecoder *const decoder);
 
 struct LocalLog;
 
+// How far local_log_append pushes a group of entries before it is considered committed.
+enum Durability {
+    // leave it to stdio and the OS
+    DurabilityNone,
+    // hand it to the OS, survives a process crash
+    DurabilityWrite,
+    // fdatasync it, survives a power loss
+    DurabilityFdatasync,
+};
+
 void local_log_init(struct LocalLog *const local_log);
 void local_log_free(struct LocalLog *const local_log);
 int local_log_append(struct LocalLog *const local_log, struct LogEntry *log_entry);
+void local_log_set_segment_size(struct LocalLog *const local_log, size_t segment_size);
+void local_log_set_durability(struct LocalLog *const local_log, enum Durability durability);
+void local_log_set_header_interval(struct LocalLog *const local_log, unsigned int interval_ms);
+void local_log_set_group_commit(struct LocalLog *const local_log,
+                                size_t max_entries, unsigned int window_ms);
+int local_log_sync(struct LocalLog *const local_log);
+void local_log_set_auto_commit(struct LocalLog *const local_log,
+                               size_t max_statements, unsigned int window_ms);
+void local_log_set_reconnect_backoff(struct LocalLog *const local_log,
+                                     unsigned int min_ms, unsigned int max_ms);
+void local_log_set_publish_window(struct LocalLog *const local_log, size_t window);
+void local_log_set_publish_envelope(struct LocalLog *const local_log,
+                                    size_t max_entries, size_t max_bytes);
+void local_log_set_publish_format(struct LocalLog *const local_log, enum PayloadFormat format);
+void local_log_set_publish_compression(struct LocalLog *const local_log, int enabled,
+                                       const void *dictionary, size_t size);
+int local_log_build_dictionary(struct LocalLog *const local_log, size_t max_entries,
+                               void *dest, size_t capacity, size_t *size);
+void local_log_publish_stats(const struct LocalLog *local_log, uint64_t *messages, uint64_t *bytes);
+int local_log_start_writer(struct LocalLog *const local_log);
+void local_log_stop_writer(struct LocalLog *const local_log);
+
+// Cursor over the local log, decoding one entry at a time. The entry returned by next is owned
+// by the cursor and is valid until the following call; it is set to NULL at the end of the log.
+struct LogCursor;
+
+int local_log_cursor_open(struct LocalLog *const local_log, uint64_t seq, struct LogCursor **dest);
+int local_log_cursor_next(struct LogCursor *const cursor, struct LogEntry **entry);
+void local_log_cursor_close(struct LogCursor *const cursor);
+
+void local_log_stmt_cache_stats(const struct LocalLog *local_log, uint64_t *hits, uint64_t *misses);
 
 int cql_open(
     const char *filename,
@@ -37,6 +136,49 @@ int cql_open(
 int cql_exec(struct LocalLog *const local_log, const char *sql,
              int (*callback) (void *, int, char **, char **), void *arg, char **errmsg);
 
+int cql_exec_args(struct LocalLog *const local_log, const char *pattern,
+                  const struct Argument *args, size_t count,
+                  int (*callback) (void *, int, char **, char **), void *arg, char **errmsg);
+
+int cql_exec_batch(struct LocalLog *const local_log, const char *pattern,
+                   const struct Argument *args, size_t columns, size_t rows, char **errmsg);
+
+// Typed, streaming access to the rows of a query, read straight from the statement without
+// rendering them as text. Column values are valid until the next call to cql_query_next or
+// cql_query_close; text and blobs are not copied, and should be read with the accessor of the
+// type cql_column_type reports. A query must be closed before the local log is freed. Queries
+// run on the connection that writes, unless local_log_open_read_pool gave them their own.
+struct QueryCursor;
+
+int local_log_open_read_pool(struct LocalLog *const local_log, size_t connections);
+
+int cql_query(struct LocalLog *const local_log, const char *pattern,
+              const struct Argument *args, size_t count, struct QueryCursor **dest, char **errmsg);
+int cql_query_next(struct QueryCursor *const cursor, char **errmsg);
+int cql_column_count(const struct QueryCursor *cursor);
+const char *cql_column_name(const struct QueryCursor *cursor, int column);
+enum Types cql_column_type(const struct QueryCursor *cursor, int column);
+int64_t cql_column_int64(const struct QueryCursor *cursor, int column);
+double cql_column_double(const struct QueryCursor *cursor, int column);
+const char *cql_column_text(const struct QueryCursor *cursor, int column, size_t *size);
+const void *cql_column_blob(const struct QueryCursor *cursor, int column, size_t *size);
+void cql_query_close(struct QueryCursor *const cursor);
+
+// Result of an entry queued by cql_exec_async.
+struct ExecTicket;
+
+int cql_exec_async(struct LocalLog *const local_log, const char *pattern,
+                   const struct Argument *args, size_t count,
+                   void (*complete) (void *, int, const char *), void *complete_arg,
+                   struct ExecTicket **ticket);
+int cql_ticket_poll(struct ExecTicket *ticket, int *rc, const char **errmsg);
+int cql_ticket_wait(struct ExecTicket *ticket, const char **errmsg);
+void cql_ticket_free(struct ExecTicket *ticket);
+
+int cql_begin(struct LocalLog *const local_log, char **errmsg);
+int cql_commit(struct LocalLog *const local_log, char **errmsg);
+int cql_rollback(struct LocalLog *const local_log, char **errmsg);
+
 int cql_sync_upstream(struct LocalLog *const local_log);
 
 int cql_publish(struct LocalLog *const local_log);
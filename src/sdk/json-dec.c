@@ -0,0 +1,344 @@
+#include "json-dec.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+void json_reader_init(struct JsonReader *const reader, const void *src, size_t count)
+{
+    reader->p = src;
+    reader->end = reader->p + count;
+}
+
+static void skip_whitespace(struct JsonReader *const reader)
+{
+    while (reader->p < reader->end
+           && (*reader->p == ' ' || *reader->p == '\n' || *reader->p == '\r' || *reader->p == '\t')) {
+        reader->p++;
+    }
+}
+
+// Next character after whitespace, or -1 at the end of the input.
+int json_reader_peek(struct JsonReader *const reader)
+{
+    skip_whitespace(reader);
+    return reader->p < reader->end ? (unsigned char)*reader->p : -1;
+}
+
+int json_reader_expect(struct JsonReader *const reader, char c)
+{
+    if (json_reader_peek(reader) != (unsigned char)c) {
+        return 1;
+    }
+    reader->p++;
+    return 0;
+}
+
+static int match_literal(struct JsonReader *const reader, const char *literal)
+{
+    size_t count = strlen(literal);
+    if ((size_t)(reader->end - reader->p) < count || memcmp(reader->p, literal, count) != 0) {
+        return 1;
+    }
+    reader->p += count;
+    return 0;
+}
+
+// Consume a null and return 1, or return 0 and leave any other value in place.
+int json_reader_is_null(struct JsonReader *const reader)
+{
+    return json_reader_peek(reader) == 'n' && match_literal(reader, "null") == 0;
+}
+
+// Read the key of the next member of an object whose "{" was consumed, and the ":" after it. *first
+// must be 1 for the first member. *key is set to NULL once the closing "}" is consumed.
+int json_reader_member(struct JsonReader *const reader, int *first, struct Arena *const arena,
+                       const char **key, size_t *key_size)
+{
+    *key = NULL;
+    int c = json_reader_peek(reader);
+    if (c == '}') {
+        reader->p++;
+        return 0;
+    }
+    if (!*first) {
+        if (c != ',') {
+            return 1;
+        }
+        reader->p++;
+    }
+    *first = 0;
+    if (json_reader_string(reader, arena, key, key_size) != 0) {
+        return 1;
+    }
+    return json_reader_expect(reader, ':');
+}
+
+// Move to the next element of an array whose "[" was consumed. *first must be 1 for the first
+// element. *more is set to 0 once the closing "]" is consumed.
+int json_reader_element(struct JsonReader *const reader, int *first, int *more)
+{
+    int c = json_reader_peek(reader);
+    *more = 0;
+    if (c == ']') {
+        reader->p++;
+        return 0;
+    }
+    if (!*first) {
+        if (c != ',') {
+            return 1;
+        }
+        reader->p++;
+    }
+    *first = 0;
+    *more = 1;
+    return 0;
+}
+
+// Move past the closing quote of a string whose opening one was consumed. *escaped is set when
+// the string has escapes.
+static int skip_string(struct JsonReader *const reader, int *escaped)
+{
+    while (reader->p < reader->end && *reader->p != '"') {
+        if (*reader->p == '\\') {
+            *escaped = 1;
+            if (++reader->p == reader->end) {
+                return 1;
+            }
+        }
+        reader->p++;
+    }
+    if (reader->p == reader->end) {
+        return 1;
+    }
+    reader->p++;
+    return 0;
+}
+
+static int hex_value(const char *src, uint32_t *value)
+{
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = src[i];
+        *value <<= 4;
+        if (c >= '0' && c <= '9') {
+            *value |= (uint32_t)(c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            *value |= (uint32_t)(c - 'a' + 10);
+        } else if (c >= 'A' && c <= 'F') {
+            *value |= (uint32_t)(c - 'A' + 10);
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Unescape a string body into dest, which is large enough for it since no escape is shorter than
+// what it decodes to.
+static int unescape(const char *src, const char *end, char *dest, size_t *count)
+{
+    char *p = dest;
+    while (src < end) {
+        if (*src != '\\') {
+            *p++ = *src++;
+            continue;
+        }
+        if (++src == end) {
+            return 1;
+        }
+        char c = *src++;
+        switch (c) {
+        case '"':
+        case '\\':
+        case '/':
+            *p++ = c;
+            break;
+        case 'b':
+            *p++ = '\b';
+            break;
+        case 'f':
+            *p++ = '\f';
+            break;
+        case 'n':
+            *p++ = '\n';
+            break;
+        case 'r':
+            *p++ = '\r';
+            break;
+        case 't':
+            *p++ = '\t';
+            break;
+        case 'u': {
+            uint32_t code;
+            if (end - src < 4 || hex_value(src, &code) != 0) {
+                return 1;
+            }
+            src += 4;
+            // A high surrogate followed by a low one encodes a code point past the BMP
+            uint32_t low;
+            if (code >= 0xd800 && code < 0xdc00 && end - src >= 6 && src[0] == '\\' && src[1] == 'u'
+                && hex_value(src + 2, &low) == 0 && low >= 0xdc00 && low < 0xe000) {
+                code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                src += 6;
+            }
+            if (code < 0x80) {
+                *p++ = (char)code;
+            } else if (code < 0x800) {
+                *p++ = (char)(0xc0 | (code >> 6));
+                *p++ = (char)(0x80 | (code & 0x3f));
+            } else if (code < 0x10000) {
+                *p++ = (char)(0xe0 | (code >> 12));
+                *p++ = (char)(0x80 | ((code >> 6) & 0x3f));
+                *p++ = (char)(0x80 | (code & 0x3f));
+            } else {
+                *p++ = (char)(0xf0 | (code >> 18));
+                *p++ = (char)(0x80 | ((code >> 12) & 0x3f));
+                *p++ = (char)(0x80 | ((code >> 6) & 0x3f));
+                *p++ = (char)(0x80 | (code & 0x3f));
+            }
+            break;
+        }
+        default:
+            return 1;
+        }
+    }
+    *count = (size_t)(p - dest);
+    return 0;
+}
+
+// Read a string. *dest points into the input when the string has no escapes, and to an unescaped
+// copy in arena otherwise; either way it is not NUL-terminated.
+int json_reader_string(struct JsonReader *const reader, struct Arena *const arena,
+                       const char **dest, size_t *count)
+{
+    if (json_reader_expect(reader, '"') != 0) {
+        return 1;
+    }
+    const char *start = reader->p;
+    int escaped = 0;
+    if (skip_string(reader, &escaped) != 0) {
+        return 1;
+    }
+    const char *end = reader->p - 1;
+    if (!escaped) {
+        *dest = start;
+        *count = (size_t)(end - start);
+        return 0;
+    }
+    char *copy = arena_alloc(arena, (size_t)(end - start));
+    if (copy == NULL || unescape(start, end, copy, count) != 0) {
+        return 1;
+    }
+    *dest = copy;
+    return 0;
+}
+
+// Read an integer; numbers with a fraction or an exponent are not integers.
+int json_reader_int64(struct JsonReader *const reader, int64_t *value)
+{
+    json_reader_peek(reader);
+    int negative = reader->p < reader->end && *reader->p == '-';
+    if (negative) {
+        reader->p++;
+    }
+    const char *start = reader->p;
+    uint64_t magnitude = 0;
+    uint64_t limit = negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+    while (reader->p < reader->end && *reader->p >= '0' && *reader->p <= '9') {
+        uint64_t digit = (uint64_t)(*reader->p - '0');
+        if (magnitude > (limit - digit) / 10) {
+            return 1;
+        }
+        magnitude = magnitude*10 + digit;
+        reader->p++;
+    }
+    if (reader->p == start
+        || (reader->p < reader->end && (*reader->p == '.' || *reader->p == 'e' || *reader->p == 'E'))) {
+        return 1;
+    }
+    *value = negative ? (int64_t)(0 - magnitude) : (int64_t)magnitude;
+    return 0;
+}
+
+// Read a number, or NaN, Infinity or -Infinity as json-c writes them.
+int json_reader_double(struct JsonReader *const reader, double *value)
+{
+    json_reader_peek(reader);
+    if (match_literal(reader, "NaN") == 0) {
+        *value = NAN;
+        return 0;
+    }
+    if (match_literal(reader, "Infinity") == 0) {
+        *value = INFINITY;
+        return 0;
+    }
+    if (match_literal(reader, "-Infinity") == 0) {
+        *value = -INFINITY;
+        return 0;
+    }
+
+    // strtod needs a terminated string, and the input is not
+    char text[64];
+    size_t count = 0;
+    while (reader->p + count < reader->end && count < sizeof(text) - 1
+           && strchr("+-.0123456789eE", reader->p[count]) != NULL) {
+        text[count] = reader->p[count];
+        count++;
+    }
+    text[count] = '\0';
+    char *end;
+    *value = strtod(text, &end);
+    if (count == 0 || end != text + count) {
+        return 1;
+    }
+    reader->p += count;
+    return 0;
+}
+
+// Skip a value of any type, nested ones included.
+int json_reader_skip(struct JsonReader *const reader)
+{
+    int escaped = 0;
+    int c = json_reader_peek(reader);
+    if (c == '"') {
+        reader->p++;
+        return skip_string(reader, &escaped);
+    }
+    if (c == '{' || c == '[') {
+        size_t depth = 0;
+        while (reader->p < reader->end) {
+            char d = *reader->p++;
+            if (d == '"') {
+                if (skip_string(reader, &escaped) != 0) {
+                    return 1;
+                }
+            } else if (d == '{' || d == '[') {
+                depth++;
+            } else if ((d == '}' || d == ']') && --depth == 0) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    // Number or literal
+    const char *start = reader->p;
+    while (reader->p < reader->end && strchr(",}] \t\r\n", *reader->p) == NULL) {
+        reader->p++;
+    }
+    return reader->p == start;
+}
+
+// Check that nothing but whitespace follows the value read last.
+int json_reader_finish(struct JsonReader *const reader)
+{
+    return json_reader_peek(reader) != -1;
+}
+
+// Whether a key read by json_reader_member is name; returns 1 if it is, 0 otherwise.
+int json_key_is(const char *key, size_t key_size, const char *name)
+{
+    return strlen(name) == key_size && memcmp(key, name, key_size) == 0;
+}
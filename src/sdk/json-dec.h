@@ -0,0 +1,42 @@
+#ifndef COVENANTSQL_JSON_DEC_H
+#define COVENANTSQL_JSON_DEC_H
+
+#include "arena.h"
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/*
+** Make sure we can call this stuff from C++.
+*/
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Pull parser over JSON text: values are read one at a time, in the order they appear, without
+// building a tree. Unless noted otherwise, functions return 0 on success and 1 on malformed or
+// unexpected input.
+struct JsonReader {
+    const char *p;
+    const char *end;
+};
+
+void json_reader_init(struct JsonReader *const reader, const void *src, size_t count);
+int json_reader_peek(struct JsonReader *const reader);
+int json_reader_expect(struct JsonReader *const reader, char c);
+int json_reader_is_null(struct JsonReader *const reader);
+int json_reader_member(struct JsonReader *const reader, int *first, struct Arena *const arena,
+                       const char **key, size_t *key_size);
+int json_reader_element(struct JsonReader *const reader, int *first, int *more);
+int json_reader_string(struct JsonReader *const reader, struct Arena *const arena,
+                       const char **dest, size_t *count);
+int json_reader_int64(struct JsonReader *const reader, int64_t *value);
+int json_reader_double(struct JsonReader *const reader, double *value);
+int json_reader_skip(struct JsonReader *const reader);
+int json_reader_finish(struct JsonReader *const reader);
+int json_key_is(const char *key, size_t key_size, const char *name);
+
+#ifdef __cplusplus
+}  /* End of the 'extern "C"' block */
+#endif
+#endif /* COVENANTSQL_JSON_DEC_H */
@@ -0,0 +1,120 @@
+#include "json-enc.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+void encode_json_literal(struct Buffer *const dest, const char *src)
+{
+    buffer_write(dest, src, strlen(src));
+}
+
+// Quote and escape a string like json-c does: quotes, backslashes, slashes and control
+// characters are escaped, everything else, UTF-8 included, is copied as it is.
+void encode_json_string(struct Buffer *const dest, const char *src, size_t count)
+{
+    static const char hex[] = "0123456789abcdef";
+    // worst case every byte becomes a \u00XX escape
+    buffer_ensure(dest, 2 + 6*count);
+    char *p = (char *)dest->buffer + dest->offset;
+    *p++ = '"';
+    for (size_t i = 0; i < count; i++) {
+        unsigned char c = (unsigned char)src[i];
+        if (c >= 0x20 && c != '"' && c != '\\' && c != '/') {
+            *p++ = (char)c;
+            continue;
+        }
+        *p++ = '\\';
+        switch (c) {
+        case '"':
+        case '\\':
+        case '/':
+            *p++ = (char)c;
+            break;
+        case '\b':
+            *p++ = 'b';
+            break;
+        case '\f':
+            *p++ = 'f';
+            break;
+        case '\n':
+            *p++ = 'n';
+            break;
+        case '\r':
+            *p++ = 'r';
+            break;
+        case '\t':
+            *p++ = 't';
+            break;
+        default:
+            *p++ = 'u';
+            *p++ = '0';
+            *p++ = '0';
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 0xf];
+            break;
+        }
+    }
+    *p++ = '"';
+    dest->offset = (size_t)(p - (char *)dest->buffer);
+}
+
+// Write an object key and the separator before its value. The key is written as it is, it must
+// not need escaping.
+void encode_json_key(struct Buffer *const dest, const char *key)
+{
+    size_t count = strlen(key);
+    buffer_ensure(dest, count + 4);
+    char *p = (char *)dest->buffer + dest->offset;
+    *p++ = '"';
+    memcpy(p, key, count);
+    p += count;
+    *p++ = '"';
+    *p++ = ':';
+    *p++ = ' ';
+    dest->offset = (size_t)(p - (char *)dest->buffer);
+}
+
+void encode_json_int64(struct Buffer *const dest, int64_t value)
+{
+    char digits[20];
+    size_t count = 0;
+    // negate as unsigned, so that INT64_MIN does not overflow
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    do {
+        digits[count++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+
+    buffer_ensure(dest, count + 1);
+    char *p = (char *)dest->buffer + dest->offset;
+    if (value < 0) {
+        *p++ = '-';
+    }
+    while (count > 0) {
+        *p++ = digits[--count];
+    }
+    dest->offset = (size_t)(p - (char *)dest->buffer);
+}
+
+// Doubles keep 17 significant digits, and a ".0" when they would otherwise read as integers.
+void encode_json_double(struct Buffer *const dest, double value)
+{
+    if (isnan(value)) {
+        encode_json_literal(dest, "NaN");
+        return;
+    }
+    if (isinf(value)) {
+        encode_json_literal(dest, value < 0 ? "-Infinity" : "Infinity");
+        return;
+    }
+    char text[32];
+    int count = snprintf(text, sizeof(text) - 2, "%.17g", value);
+    if (strpbrk(text, ".eE") == NULL) {
+        text[count++] = '.';
+        text[count++] = '0';
+    }
+    buffer_write(dest, text, (size_t)count);
+}
@@ -0,0 +1,26 @@
+#ifndef COVENANTSQL_JSON_ENC_H
+#define COVENANTSQL_JSON_ENC_H
+
+#include "buffer.h"
+
+#include <inttypes.h>
+
+/*
+** Make sure we can call this stuff from C++.
+*/
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Append JSON values to a buffer as text, formatted the way json-c prints them with
+// JSON_C_TO_STRING_SPACED, without building json-c objects first.
+void encode_json_literal(struct Buffer *const dest, const char *src);
+void encode_json_string(struct Buffer *const dest, const char *src, size_t count);
+void encode_json_key(struct Buffer *const dest, const char *key);
+void encode_json_int64(struct Buffer *const dest, int64_t value);
+void encode_json_double(struct Buffer *const dest, double value);
+
+#ifdef __cplusplus
+}  /* End of the 'extern "C"' block */
+#endif
+#endif /* COVENANTSQL_JSON_ENC_H */
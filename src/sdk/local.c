@@ -1,7 +1,16 @@
+#include "arena.h"
 #include "buffer.h"
 #include "base-enc.h"
+#include "json-dec.h"
+#include "json-enc.h"
+#include "lz.h"
 #include "local.h"
+#include "mpsc-queue.h"
+#include "read-pool.h"
+#include "stmt-cache.h"
+#include "covenant-iot.h"
 
+#include <ctype.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -9,22 +18,17 @@
 #include <string.h>
 
 #include <endian.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
 #include <unistd.h>
 
-enum Types {
-    Null, String, Int, Float, Blob,
-};
-
-struct Argument {
-    char* name;
-    void* value;
-    enum Types type;
-};
-
 void argument_init(struct Argument *const arg)
 {
     arg->name = NULL;
+    arg->name_size = 0;
     arg->value = NULL;
+    arg->size = 0;
 }
 
 void argument_free(struct Argument *const arg)
@@ -36,14 +40,15 @@ void argument_free(struct Argument *const arg)
 
 void encode_argument(struct Buffer *const dest, struct Argument *arg)
 {
-    encode_string(dest, arg->name);
+    encode_bytes(dest, arg->name, arg->name_size);
     encode_uint8(dest, (uint8_t)arg->type);
 
     switch (arg->type) {
     case Null:
         break;
     case String:
-        encode_string(dest, (char *)arg->value);
+    case Blob:
+        encode_bytes(dest, arg->value, arg->size);
         break;
     case Int:
         encode_uint64(dest, *(uint64_t *)arg->value);
@@ -51,9 +56,6 @@ void encode_argument(struct Buffer *const dest, struct Argument *arg)
     case Float:
         encode_double(dest, *(double *)arg->value);
         break;
-    case Blob:
-        encode_blob(dest, (struct Blob*)arg->value);
-        break;
     default:
         break;
     }
@@ -63,18 +65,24 @@ int encode_argument_json(struct json_object* dest, const struct Argument *src)
 {
     int rc;
 
-    if ((rc = json_object_object_add(dest, "name", json_object_new_string(src->name))) != 0 ||
+    struct json_object *name = NULL;
+    if (src->name != NULL) {
+        name = json_object_new_string_len(src->name, (int)src->name_size);
+    }
+    if ((rc = json_object_object_add(dest, "name", name)) != 0 ||
         (rc = json_object_object_add(dest, "type", json_object_new_int((int32_t)src->type)) != 0)) {
         return rc;
     }
 
-    struct Blob *blob = NULL;
     switch (src->type) {
     case Null:
         rc = json_object_object_add(dest, "value", NULL);
         break;
     case String:
-        rc = json_object_object_add(dest, "value", json_object_new_string((char *)src->value));
+    case Blob:
+        // TODO(leventeliu): base64 encoding for blobs.
+        rc = json_object_object_add(
+                 dest, "value", json_object_new_string_len((char *)src->value, (int)src->size));
         break;
     case Int:
         rc = json_object_object_add(dest, "value", json_object_new_int64(*(int64_t *)src->value));
@@ -82,10 +90,6 @@ int encode_argument_json(struct json_object* dest, const struct Argument *src)
     case Float:
         rc = json_object_object_add(dest, "value", json_object_new_double(*(double *)src->value));
         break;
-    case Blob:
-        blob = (struct Blob *)src->value;
-        rc = json_object_object_add(dest, "value", json_object_new_string_len((char *)blob->buffer, blob->count));
-        break;
     default:
         break;
     }
@@ -93,22 +97,25 @@ int encode_argument_json(struct json_object* dest, const struct Argument *src)
     return rc;
 }
 
-int decode_argument(struct Buffer *const src, struct Argument **dest)
+// Decode an argument into arena, it is released together with the arena. Name and string or blob
+// values are views into src.
+int decode_argument(struct Buffer *const src, struct Arena *const arena, struct Argument **dest)
 {
     int rc;
-    struct Argument *ddest = malloc(sizeof(*ddest));
+    struct Argument *ddest = arena_alloc(arena, sizeof(*ddest));
+    if (ddest == NULL) {
+        return -1;
+    }
     argument_init(ddest);
 
-    rc = decode_string(src, &ddest->name);
+    rc = decode_bytes_view(src, (const void **)&ddest->name, &ddest->name_size);
     if (rc != 0) {
-        argument_free(ddest);
         return rc;
     }
 
     uint8_t type;
     rc = decode_uint8(src, &type);
     if (rc != 0) {
-        argument_free(ddest);
         return rc;
     }
     ddest->type = type;
@@ -117,22 +124,25 @@ int decode_argument(struct Buffer *const src, struct Argument **dest)
     case Null:
         break;
     case String:
-        rc = decode_string(src, (char **)(&ddest->value));
+    case Blob:
+        rc = decode_bytes_view(src, (const void **)&ddest->value, &ddest->size);
         break;
     case Int:
-        rc = decode_uint64_pointer(src, (uint64_t **)(&ddest->value));
+        if ((ddest->value = arena_alloc(arena, sizeof(uint64_t))) == NULL) {
+            return -1;
+        }
+        rc = decode_uint64(src, (uint64_t *)ddest->value);
         break;
     case Float:
-        rc = decode_double_pointer(src, (double **)(&ddest->value));
-        break;
-    case Blob:
-        rc = decode_blob(src, (struct Blob **)(&ddest->value));
+        if ((ddest->value = arena_alloc(arena, sizeof(double))) == NULL) {
+            return -1;
+        }
+        rc = decode_double(src, (double *)ddest->value);
         break;
     default:
         break;
     }
     if (rc != 0) {
-        argument_free(ddest);
         return rc;
     }
 
@@ -157,8 +167,8 @@ int decode_argument_json(const struct json_object *obj, struct Argument **dest)
             argument_free(ddest);
             return 1;
         }
-        ddest->name = strndup(json_object_get_string(value),
-                              (size_t)json_object_get_string_len(value));
+        ddest->name_size = (size_t)json_object_get_string_len(value);
+        ddest->name = strndup(json_object_get_string(value), ddest->name_size);
     }
 
     // "type"
@@ -193,8 +203,8 @@ int decode_argument_json(const struct json_object *obj, struct Argument **dest)
             argument_free(ddest);
             return 1;
         }
-        ddest->value = strndup(json_object_get_string(value),
-                               (size_t)json_object_get_string_len(value));
+        ddest->size = (size_t)json_object_get_string_len(value);
+        ddest->value = strndup(json_object_get_string(value), ddest->size);
         break;
     case Int:
         if (json_object_is_type(value, json_type_int) == 0) {
@@ -223,8 +233,8 @@ int decode_argument_json(const struct json_object *obj, struct Argument **dest)
             argument_free(ddest);
             return 1;
         }
-        ddest->value = strndup(json_object_get_string(value),
-                               (size_t)json_object_get_string_len(value));
+        ddest->size = (size_t)json_object_get_string_len(value);
+        ddest->value = strndup(json_object_get_string(value), ddest->size);
         break;
     default:
         break;
@@ -236,6 +246,7 @@ int decode_argument_json(const struct json_object *obj, struct Argument **dest)
 
 struct Event {
     char* pattern;
+    size_t pattern_size;
     size_t count;
     struct Argument* args[];
 };
@@ -243,6 +254,7 @@ struct Event {
 void event_init(struct Event *const event)
 {
     event->pattern = NULL;
+    event->pattern_size = 0;
     event->count = 0;
 }
 
@@ -250,14 +262,14 @@ void event_free(struct Event *const event)
 {
     free(event->pattern);
     for (size_t i = 0; i < event->count; i++) {
-        free(event->args[i]);
+        argument_free(event->args[i]);
     }
     free(event);
 }
 
 void encode_event(struct Buffer *const dest, const struct Event *src)
 {
-    encode_string(dest, src->pattern);
+    encode_bytes(dest, src->pattern, src->pattern_size);
     encode_uint32(dest, (uint32_t)src->count);
     for (size_t i = 0; i < src->count; i++) {
         encode_argument(dest, src->args[i]);
@@ -270,7 +282,8 @@ int encode_event_json(struct json_object* dest, const struct Event *src)
     struct json_object *args;
     struct json_object *arg;
 
-    if ((rc = json_object_object_add(dest, "pattern", json_object_new_string(src->pattern))) != 0 ||
+    if ((rc = json_object_object_add(
+                  dest, "pattern", json_object_new_string_len(src->pattern, (int)src->pattern_size))) != 0 ||
         (rc = json_object_object_add(dest, "args", (args = json_object_new_array())) != 0)) {
         return rc;
     }
@@ -287,31 +300,29 @@ int encode_event_json(struct json_object* dest, const struct Event *src)
     return 0;
 }
 
-int decode_event(struct Buffer *const src, struct Event **dest)
+// Decode an event into arena, it is released together with the arena. The pattern is a view into
+// src.
+int decode_event(struct Buffer *const src, struct Arena *const arena, struct Event **dest)
 {
     int rc;
-    struct Event *ddest = malloc(sizeof(*ddest));
-    event_init(ddest);
-
-    rc = decode_string(src, &ddest->pattern);
-    if (rc != 0) {
-        event_free(ddest);
-        return rc;
-    }
-
+    const void *pattern;
+    size_t pattern_size;
     uint32_t count;
-    rc = decode_uint32(src, &count);
-    if (rc != 0) {
-        event_free(ddest);
+    if ((rc = decode_bytes_view(src, &pattern, &pattern_size)) != 0
+        || (rc = decode_uint32(src, &count)) != 0) {
         return rc;
     }
 
+    struct Event *ddest = arena_alloc(arena, sizeof(*ddest) + count*sizeof(void *));
+    if (ddest == NULL) {
+        return -1;
+    }
+    ddest->pattern = (char *)pattern;
+    ddest->pattern_size = pattern_size;
     ddest->count = (size_t)count;
-    ddest = realloc((void *)ddest, sizeof(*ddest) + count*sizeof(void *));
     for (size_t i = 0; i < ddest->count; i++) {
-        rc = decode_argument(src, &(ddest->args[i]));
+        rc = decode_argument(src, arena, &(ddest->args[i]));
         if (rc != 0) {
-            event_free(ddest);
             return rc;
         }
     }
@@ -339,8 +350,8 @@ int decode_event_json(const struct json_object *obj, struct Event **dest)
         event_free(ddest);
         return 1;
     }
-    ddest->pattern = strndup(json_object_get_string(value),
-                             (size_t)json_object_get_string_len(value));
+    ddest->pattern_size = (size_t)json_object_get_string_len(value);
+    ddest->pattern = strndup(json_object_get_string(value), ddest->pattern_size);
     printf("decode pattern: %s\n", ddest->pattern);
 
     // "args", nullable
@@ -376,6 +387,7 @@ struct LogEntry {
     uint64_t block_id;
     uint64_t block_index;
     char *client_id;
+    size_t client_id_size;
     uint64_t seq;
     size_t count;
     struct Event* events[];
@@ -384,6 +396,7 @@ struct LogEntry {
 void log_entry_init(struct LogEntry *const log_entry)
 {
     log_entry->client_id = NULL;
+    log_entry->client_id_size = 0;
     log_entry->count = 0;
 }
 
@@ -400,7 +413,7 @@ void encode_log_entry(struct Buffer *const dest, const struct LogEntry *src)
 {
     encode_uint64(dest, src->block_id);
     encode_uint64(dest, src->block_index);
-    encode_string(dest, src->client_id);
+    encode_bytes(dest, src->client_id, src->client_id_size);
     encode_uint64(dest, src->seq);
     encode_uint32(dest, (uint32_t)src->count);
     for (size_t i = 0; i < src->count; i++) {
@@ -408,15 +421,14 @@ void encode_log_entry(struct Buffer *const dest, const struct LogEntry *src)
     }
 }
 
-int encode_log_entry_json(struct json_object *const dest, const struct LogEntry *src)
+// Add the "events" of an entry to dest.
+int encode_log_entry_events_json(struct json_object *const dest, const struct LogEntry *src)
 {
     int rc;
     struct json_object *events;
     struct json_object *event;
 
-    if ((rc = json_object_object_add(dest, "client_id", json_object_new_string(src->client_id))) != 0 ||
-        (rc = json_object_object_add(dest, "client_seq", json_object_new_int64((int64_t)src->seq)) != 0) ||
-        (rc = json_object_object_add(dest, "events", (events = json_object_new_array())) != 0)) {
+    if ((rc = json_object_object_add(dest, "events", (events = json_object_new_array())) != 0)) {
         return rc;
     }
 
@@ -432,33 +444,126 @@ int encode_log_entry_json(struct json_object *const dest, const struct LogEntry
     return 0;
 }
 
-int decode_log_entry(struct Buffer *const src, struct LogEntry **dest)
+int encode_log_entry_json(struct json_object *const dest, const struct LogEntry *src)
 {
     int rc;
-    struct LogEntry *ddest = malloc(sizeof(*ddest));
-    log_entry_init(ddest);
-
-    if ((rc = decode_uint64(src, &ddest->block_id)) != 0
-        || (rc = decode_uint64(src, &ddest->block_index) != 0)
-        || (rc = decode_string(src, &ddest->client_id) != 0)
-        || (rc = decode_uint64(src, &ddest->seq) != 0)) {
-        log_entry_free(ddest);
+    if ((rc = json_object_object_add(
+                  dest, "client_id", json_object_new_string_len(src->client_id, (int)src->client_id_size))) != 0 ||
+        (rc = json_object_object_add(dest, "client_seq", json_object_new_int64((int64_t)src->seq)) != 0)) {
         return rc;
     }
+    return encode_log_entry_events_json(dest, src);
+}
+
+// The write_*_json functions below append the same JSON as the encode_*_json ones followed by
+// json_object_to_json_string_length with JSON_C_TO_STRING_SPACED, straight into a buffer.
+void write_argument_json(struct Buffer *const dest, const struct Argument *src)
+{
+    encode_json_literal(dest, "{ ");
+    encode_json_key(dest, "name");
+    if (src->name != NULL) {
+        encode_json_string(dest, src->name, src->name_size);
+    } else {
+        encode_json_literal(dest, "null");
+    }
+    encode_json_literal(dest, ", ");
+    encode_json_key(dest, "type");
+    encode_json_int64(dest, (int64_t)src->type);
+
+    switch (src->type) {
+    case Null:
+        encode_json_literal(dest, ", ");
+        encode_json_key(dest, "value");
+        encode_json_literal(dest, "null");
+        break;
+    case String:
+    case Blob:
+        encode_json_literal(dest, ", ");
+        encode_json_key(dest, "value");
+        encode_json_string(dest, (const char *)src->value, src->size);
+        break;
+    case Int:
+        encode_json_literal(dest, ", ");
+        encode_json_key(dest, "value");
+        encode_json_int64(dest, *(int64_t *)src->value);
+        break;
+    case Float:
+        encode_json_literal(dest, ", ");
+        encode_json_key(dest, "value");
+        encode_json_double(dest, *(double *)src->value);
+        break;
+    default:
+        break;
+    }
+    encode_json_literal(dest, " }");
+}
+
+void write_event_json(struct Buffer *const dest, const struct Event *src)
+{
+    encode_json_literal(dest, "{ ");
+    encode_json_key(dest, "pattern");
+    encode_json_string(dest, src->pattern, src->pattern_size);
+    encode_json_literal(dest, ", ");
+    encode_json_key(dest, "args");
+    encode_json_literal(dest, "[");
+    for (size_t i = 0; i < src->count; i++) {
+        encode_json_literal(dest, i > 0 ? ", " : " ");
+        write_argument_json(dest, src->args[i]);
+    }
+    encode_json_literal(dest, " ] }");
+}
+
+// Write the "events" member of an entry, without the braces around it.
+void write_log_entry_events_json(struct Buffer *const dest, const struct LogEntry *src)
+{
+    encode_json_key(dest, "events");
+    encode_json_literal(dest, "[");
+    for (size_t i = 0; i < src->count; i++) {
+        encode_json_literal(dest, i > 0 ? ", " : " ");
+        write_event_json(dest, src->events[i]);
+    }
+    encode_json_literal(dest, " ]");
+}
+
+void write_log_entry_json(struct Buffer *const dest, const struct LogEntry *src)
+{
+    encode_json_literal(dest, "{ ");
+    encode_json_key(dest, "client_id");
+    encode_json_string(dest, src->client_id, src->client_id_size);
+    encode_json_literal(dest, ", ");
+    encode_json_key(dest, "client_seq");
+    encode_json_int64(dest, (int64_t)src->seq);
+    encode_json_literal(dest, ", ");
+    write_log_entry_events_json(dest, src);
+    encode_json_literal(dest, " }");
+}
 
+// Decode a log entry into arena in one region. Unlike entries decoded from JSON it must not be
+// passed to log_entry_free, it is released by resetting or freeing the arena. Strings and blobs
+// are views into src, which should be a mapping so that they stay valid while the entry is used.
+int decode_log_entry(struct Buffer *const src, struct Arena *const arena, struct LogEntry **dest)
+{
+    int rc;
+    struct LogEntry entry;
     uint32_t count;
-    rc = decode_uint32(src, &count);
-    if (rc != 0) {
-        log_entry_free(ddest);
+
+    if ((rc = decode_uint64(src, &entry.block_id)) != 0
+        || (rc = decode_uint64(src, &entry.block_index)) != 0
+        || (rc = decode_bytes_view(src, (const void **)&entry.client_id, &entry.client_id_size)) != 0
+        || (rc = decode_uint64(src, &entry.seq)) != 0
+        || (rc = decode_uint32(src, &count)) != 0) {
         return rc;
     }
 
+    struct LogEntry *ddest = arena_alloc(arena, sizeof(*ddest) + count*sizeof(void *));
+    if (ddest == NULL) {
+        return -1;
+    }
+    *ddest = entry;
     ddest->count = (size_t)count;
-    ddest = realloc((void *)ddest, sizeof(*ddest) + count*sizeof(void *));
     for (size_t i = 0; i < ddest->count; i++) {
-        rc = decode_event(src, &(ddest->events[i]));
+        rc = decode_event(src, arena, &(ddest->events[i]));
         if (rc != 0) {
-            log_entry_free(ddest);
             return rc;
         }
     }
@@ -504,8 +609,8 @@ int decode_log_entry_json(const struct json_object *obj, struct LogEntry **dest)
             log_entry_free(ddest);
             return 1;
         }
-        ddest->client_id = strndup(json_object_get_string(value),
-                                   (size_t)json_object_get_string_len(value));
+        ddest->client_id_size = (size_t)json_object_get_string_len(value);
+        ddest->client_id = strndup(json_object_get_string(value), ddest->client_id_size);
         printf("parsed client_id %s\n", ddest->client_id);
     }
 
@@ -579,12 +684,345 @@ int decode_log_entry_json(const struct json_object *obj, struct LogEntry **dest)
     return 0;
 }
 
+// An envelope carries a contiguous range of entries of one client in a single message:
+//   {"client_id": ..., "client_seq": <seq of the first entry>, "entries": [{"events": [...]}, ...]}
+// Decode one, or a single entry as published without envelopes, into an array of entries.
+int decode_log_envelope_json(const struct json_object *obj, struct LogEntry ***dest, size_t *count)
+{
+    int rc = 0;
+    struct json_object *value = NULL;
+    if (json_object_object_get_ex(obj, "entries", &value) == 0) {
+        struct LogEntry **ddest = malloc(1*sizeof(void *));
+        if ((rc = decode_log_entry_json(obj, &ddest[0])) != 0) {
+            free(ddest);
+            return rc;
+        }
+        *dest = ddest;
+        *count = 1;
+        return 0;
+    }
+    if (json_object_is_type(value, json_type_array) == 0) {
+        printf("unexpected entries type\n");
+        return 1;
+    }
+    struct json_object *entries = value;
+
+    const char *client_id = NULL;
+    size_t client_id_size = 0;
+    if (json_object_object_get_ex(obj, "client_id", &value) != 0
+        && json_object_is_type(value, json_type_string) != 0) {
+        client_id = json_object_get_string(value);
+        client_id_size = (size_t)json_object_get_string_len(value);
+    }
+    if (json_object_object_get_ex(obj, "client_seq", &value) == 0
+        || json_object_is_type(value, json_type_int) == 0) {
+        printf("field client_seq not found\n");
+        return 1;
+    }
+    uint64_t seq = (uint64_t)json_object_get_int64(value);
+
+    size_t entry_count = json_object_array_length(entries);
+    struct LogEntry **ddest = malloc((entry_count > 0 ? entry_count : 1)*sizeof(void *));
+    for (size_t i = 0; i < entry_count; i++) {
+        struct json_object *iter = json_object_array_get_idx(entries, i);
+        struct json_object *events = NULL;
+        size_t event_count = 0;
+        if (json_object_object_get_ex(iter, "events", &events) != 0
+            && json_object_is_type(events, json_type_null) == 0) {
+            if (json_object_is_type(events, json_type_array) == 0) {
+                printf("unexpected events type\n");
+                rc = 1;
+            } else {
+                event_count = json_object_array_length(events);
+            }
+        }
+        struct LogEntry *entry = malloc(sizeof(*entry) + event_count*sizeof(void *));
+        log_entry_init(entry);
+        if (client_id != NULL) {
+            entry->client_id = strndup(client_id, client_id_size);
+            entry->client_id_size = client_id_size;
+        }
+        entry->block_id = 0;
+        entry->block_index = 0;
+        entry->seq = seq + i;
+        ddest[i] = entry;
+        for (size_t j = 0; j < event_count && rc == 0; j++) {
+            if ((rc = decode_event_json(json_object_array_get_idx(events, j), &entry->events[j])) == 0) {
+                entry->count++;
+            }
+        }
+        if (rc != 0) {
+            printf("failed to decode entry at index %zd\n", i);
+            for (size_t j = 0; j <= i; j++) {
+                log_entry_free(ddest[j]);
+            }
+            free(ddest);
+            return rc;
+        }
+    }
+    *dest = ddest;
+    *count = entry_count;
+    return 0;
+}
+
+// Pointers collected in an arena while their final count is not known yet.
+struct PointerList {
+    void **items;
+    size_t count;
+    size_t capacity;
+};
+
+int pointer_list_add(struct PointerList *const list, struct Arena *const arena, void *item)
+{
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity > 0 ? 2*list->capacity : 8;
+        void **items = arena_alloc(arena, capacity*sizeof(void *));
+        if (items == NULL) {
+            return 1;
+        }
+        if (list->count > 0) {
+            memcpy(items, list->items, list->count*sizeof(void *));
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = item;
+    return 0;
+}
+
+// The read_*_json functions below decode the same JSON as the decode_*_json ones in a single pass
+// over the text, without a json-c tree. Members may come in any order and unknown ones are
+// skipped. Everything is allocated in arena, and strings without escapes are views into the text.
+int read_argument_json(struct JsonReader *const reader, struct Arena *const arena,
+                       struct Argument **dest)
+{
+    struct Argument *ddest = arena_alloc(arena, sizeof(*ddest));
+    if (ddest == NULL || json_reader_expect(reader, '{') != 0) {
+        return 1;
+    }
+    argument_init(ddest);
+
+    // The value is read once the type is known, which may come after it
+    struct JsonReader value = { NULL, NULL };
+    int64_t type = -1;
+    int first = 1;
+    const char *key;
+    size_t key_size;
+    int rc;
+    while ((rc = json_reader_member(reader, &first, arena, &key, &key_size)) == 0 && key != NULL) {
+        if (json_key_is(key, key_size, "name")) {
+            if (!json_reader_is_null(reader)) {
+                rc = json_reader_string(reader, arena, (const char **)&ddest->name, &ddest->name_size);
+            }
+        } else if (json_key_is(key, key_size, "type")) {
+            rc = json_reader_int64(reader, &type);
+        } else if (json_key_is(key, key_size, "value")) {
+            value = *reader;
+            rc = json_reader_skip(reader);
+        } else {
+            rc = json_reader_skip(reader);
+        }
+        if (rc != 0) {
+            printf("unexpected argument member\n");
+            return 1;
+        }
+    }
+    if (rc != 0) {
+        printf("malformed argument\n");
+        return 1;
+    }
+    if (type < 0) {
+        printf("field type not found\n");
+        return 1;
+    }
+    ddest->type = (enum Types)type;
+    if (ddest->type == Null) {
+        *dest = ddest;
+        return 0;
+    }
+    if (value.p == NULL) {
+        printf("field value not found\n");
+        return 1;
+    }
+
+    switch (ddest->type) {
+    case String:
+    case Blob:
+        // TODO(leventeliu): base64 decoding.
+        rc = json_reader_string(&value, arena, (const char **)&ddest->value, &ddest->size);
+        break;
+    case Int:
+        if ((ddest->value = arena_alloc(arena, sizeof(int64_t))) == NULL) {
+            return 1;
+        }
+        rc = json_reader_int64(&value, (int64_t *)ddest->value);
+        break;
+    case Float:
+        if ((ddest->value = arena_alloc(arena, sizeof(double))) == NULL) {
+            return 1;
+        }
+        rc = json_reader_double(&value, (double *)ddest->value);
+        break;
+    default:
+        break;
+    }
+    if (rc != 0) {
+        printf("unexpected object type\n");
+        return rc;
+    }
+    *dest = ddest;
+    return 0;
+}
+
+int read_event_json(struct JsonReader *const reader, struct Arena *const arena, struct Event **dest)
+{
+    if (json_reader_expect(reader, '{') != 0) {
+        return 1;
+    }
+    const char *pattern = NULL;
+    size_t pattern_size = 0;
+    struct PointerList args = { NULL, 0, 0 };
+    int first = 1;
+    const char *key;
+    size_t key_size;
+    int rc;
+    while ((rc = json_reader_member(reader, &first, arena, &key, &key_size)) == 0 && key != NULL) {
+        if (json_key_is(key, key_size, "pattern")) {
+            rc = json_reader_string(reader, arena, &pattern, &pattern_size);
+        } else if (json_key_is(key, key_size, "args")) {
+            if (!json_reader_is_null(reader)) {
+                int first_arg = 1;
+                int more;
+                rc = json_reader_expect(reader, '[');
+                while (rc == 0 && (rc = json_reader_element(reader, &first_arg, &more)) == 0 && more) {
+                    struct Argument *arg;
+                    if ((rc = read_argument_json(reader, arena, &arg)) == 0) {
+                        rc = pointer_list_add(&args, arena, arg);
+                    }
+                }
+            }
+        } else {
+            rc = json_reader_skip(reader);
+        }
+        if (rc != 0) {
+            printf("failed to decode event member %.*s\n", (int)key_size, key);
+            return 1;
+        }
+    }
+    if (rc != 0) {
+        printf("malformed event\n");
+        return 1;
+    }
+    if (pattern == NULL) {
+        printf("field pattern not found\n");
+        return 1;
+    }
+
+    struct Event *ddest = arena_alloc(arena, sizeof(*ddest) + args.count*sizeof(void *));
+    if (ddest == NULL) {
+        return 1;
+    }
+    ddest->pattern = (char *)pattern;
+    ddest->pattern_size = pattern_size;
+    ddest->count = args.count;
+    if (args.count > 0) {
+        memcpy(ddest->args, args.items, args.count*sizeof(void *));
+    }
+    *dest = ddest;
+    return 0;
+}
+
+int read_log_entry_json(struct JsonReader *const reader, struct Arena *const arena,
+                        struct LogEntry **dest)
+{
+    if (json_reader_expect(reader, '{') != 0) {
+        printf("failed to parse json object\n");
+        return 1;
+    }
+    struct LogEntry entry;
+    log_entry_init(&entry);
+    entry.seq = 0;
+    int has_block_id = 0;
+    int has_block_index = 0;
+    struct PointerList events = { NULL, 0, 0 };
+    int first = 1;
+    const char *key;
+    size_t key_size;
+    int rc;
+    while ((rc = json_reader_member(reader, &first, arena, &key, &key_size)) == 0 && key != NULL) {
+        int64_t value;
+        if (json_key_is(key, key_size, "client_id")) {
+            if (!json_reader_is_null(reader)) {
+                rc = json_reader_string(reader, arena, (const char **)&entry.client_id,
+                                        &entry.client_id_size);
+            }
+        } else if (json_key_is(key, key_size, "client_seq")) {
+            if (!json_reader_is_null(reader) && (rc = json_reader_int64(reader, &value)) == 0) {
+                entry.seq = (uint64_t)value;
+            }
+        } else if (json_key_is(key, key_size, "block_id")) {
+            if ((rc = json_reader_int64(reader, &value)) == 0) {
+                entry.block_id = (uint64_t)value;
+                has_block_id = 1;
+            }
+        } else if (json_key_is(key, key_size, "block_index")) {
+            if ((rc = json_reader_int64(reader, &value)) == 0) {
+                entry.block_index = (uint64_t)value;
+                has_block_index = 1;
+            }
+        } else if (json_key_is(key, key_size, "events")) {
+            if (!json_reader_is_null(reader)) {
+                int first_event = 1;
+                int more;
+                rc = json_reader_expect(reader, '[');
+                while (rc == 0 && (rc = json_reader_element(reader, &first_event, &more)) == 0 && more) {
+                    struct Event *event;
+                    if ((rc = read_event_json(reader, arena, &event)) == 0) {
+                        rc = pointer_list_add(&events, arena, event);
+                    }
+                }
+            }
+        } else {
+            rc = json_reader_skip(reader);
+        }
+        if (rc != 0) {
+            printf("failed to decode entry member %.*s\n", (int)key_size, key);
+            return 1;
+        }
+    }
+    if (rc != 0 || json_reader_finish(reader) != 0) {
+        printf("malformed entry\n");
+        return 1;
+    }
+    if (!has_block_id || !has_block_index) {
+        printf("field %s not found\n", has_block_id ? "block_index" : "block_id");
+        return 1;
+    }
+
+    struct LogEntry *ddest = arena_alloc(arena, sizeof(*ddest) + events.count*sizeof(void *));
+    if (ddest == NULL) {
+        return 1;
+    }
+    *ddest = entry;
+    ddest->count = events.count;
+    if (events.count > 0) {
+        memcpy(ddest->events, events.items, events.count*sizeof(void *));
+    }
+    *dest = ddest;
+    return 0;
+}
+
 #define LOCAL_LOG_MAGIC     0x2e43514c
-#define LOCAL_LOG_VERSION   0x01
+#define LOCAL_LOG_VERSION   0x03
+// The header file holds two header slots on separate pages. Each update goes to the slot not
+// holding the current header, so a torn write can only damage the older copy.
+#define LOCAL_LOG_SLOT_SIZE 4096
 
 struct LocalLogHeader {
     uint32_t magic;
     uint32_t version;
+    // bumped on every write, the valid slot with the greater one is current
+    uint64_t generation;
     // local data version
     uint64_t block_id;
     uint64_t block_index;
@@ -592,112 +1030,527 @@ struct LocalLogHeader {
     uint64_t next_publish;
     // next sequence for new events
     uint64_t sequence;
+    // next sequence not yet committed by chain
+    uint64_t next_commit;
+    // entries still kept in segments
     uint32_t entries;
-    uint16_t salt;
-    uint16_t checksum;
+    uint32_t salt;
+    // crc32 of all the fields above
+    uint32_t checksum;
 };
 
 void encode_local_log_header(struct Buffer *const dest, const struct LocalLogHeader *src)
 {
+    size_t start = dest->offset;
     encode_uint32(dest, src->magic);
     encode_uint32(dest, src->version);
+    encode_uint64(dest, src->generation);
     encode_uint64(dest, src->block_id);
     encode_uint64(dest, src->block_index);
     encode_uint64(dest, src->next_publish);
     encode_uint64(dest, src->sequence);
+    encode_uint64(dest, src->next_commit);
     encode_uint32(dest, src->entries);
-    encode_uint16(dest, src->salt);
-    encode_uint16(dest, src->checksum);
+    encode_uint32(dest, src->salt);
+    encode_uint32(dest, checksum_crc32(dest->buffer + start, dest->offset - start));
 }
 
 int decode_local_log_header(struct Buffer *const src, struct LocalLogHeader **dest)
 {
     int rc;
+    size_t start = src->read_p;
     struct LocalLogHeader *ddest = malloc(sizeof(*ddest));
     if ((rc = decode_uint32(src, &ddest->magic)) != 0
         || (rc = decode_uint32(src, &ddest->version)) != 0
+        || (rc = decode_uint64(src, &ddest->generation)) != 0
         || (rc = decode_uint64(src, &ddest->block_id)) != 0
         || (rc = decode_uint64(src, &ddest->block_index)) != 0
         || (rc = decode_uint64(src, &ddest->next_publish)) != 0
         || (rc = decode_uint64(src, &ddest->sequence)) != 0
+        || (rc = decode_uint64(src, &ddest->next_commit)) != 0
         || (rc = decode_uint32(src, &ddest->entries)) != 0
-        || (rc = decode_uint16(src, &ddest->salt)) != 0
-        || (rc = decode_uint16(src, &ddest->checksum)) != 0) {
+        || (rc = decode_uint32(src, &ddest->salt)) != 0) {
+        free(ddest);
+        return rc;
+    }
+    uint32_t checksum = checksum_crc32(src->buffer + start, src->read_p - start);
+    if ((rc = decode_uint32(src, &ddest->checksum)) != 0) {
         free(ddest);
         return rc;
     }
+    if (ddest->checksum != checksum) {
+        free(ddest);
+        return 1;
+    }
 
     *dest = ddest;
     return 0;
 }
 
-struct LocalLog {
-    char *filename;
-    char *client_id;
-    char *address;
-    char *user;
-    char *password;
-    char *topic;
-
-    FILE *fp;
-    sqlite3 *db;
-
-    struct LocalLogHeader *header;
+#define LOCAL_INDEX_MAGIC       0x2e515849
+#define LOCAL_INDEX_VERSION     0x01
+// encoded size of struct LocalIndexHeader
+#define LOCAL_INDEX_HEADER_SIZE 16
+// every index record is a big-endian uint64 file offset
+#define LOCAL_INDEX_RECORD_SIZE 8
+
+// Each segment has an index file that maps its log sequences to the byte offsets of their entries
+// in the segment: record i holds the offset of sequence first_seq+i. Records are fixed-width so
+// that a lookup is a single positioned read (or a pointer dereference if the file is mapped).
+struct LocalIndexHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t first_seq;
 };
 
-void local_log_init(struct LocalLog *const local_log)
+void encode_local_index_header(struct Buffer *const dest, const struct LocalIndexHeader *src)
 {
-    local_log->filename = NULL;
-    local_log->client_id = NULL;
-    local_log->address = NULL;
-    local_log->user = NULL;
-    local_log->password = NULL;
-    local_log->topic = NULL;
-
-    local_log->fp = NULL;
-    local_log->db = NULL;
+    encode_uint32(dest, src->magic);
+    encode_uint32(dest, src->version);
+    encode_uint64(dest, src->first_seq);
+}
+
+int decode_local_index_header(struct Buffer *const src, struct LocalIndexHeader *const dest)
+{
+    int rc;
+    if ((rc = decode_uint32(src, &dest->magic)) != 0
+        || (rc = decode_uint32(src, &dest->version)) != 0
+        || (rc = decode_uint64(src, &dest->first_seq)) != 0) {
+        return rc;
+    }
+    return 0;
+}
+
+#define LOCAL_MANIFEST_MAGIC    0x2e514d46
+#define LOCAL_MANIFEST_VERSION  0x01
+// default size a segment grows to before a new one is started
+#define LOCAL_SEGMENT_SIZE      (1 << 20)
+// block size of the arenas entries are decoded into, large enough for a typical entry
+#define LOCAL_LOG_ARENA_BLOCK_SIZE 4096
+// prepared statements kept per local log
+#define LOCAL_STMT_CACHE_SIZE 32
+// submissions the writer thread runs in one transaction at most
+#define LOCAL_WRITER_BATCH_SIZE 256
+// MQTT keepalive, and the bounds of the delay between attempts to reconnect to the broker
+#define LOCAL_MQTT_KEEPALIVE_S 20
+#define LOCAL_MQTT_RECONNECT_MIN_MS 500
+#define LOCAL_MQTT_RECONNECT_MAX_MS 60000
+// default number of messages cql_publish keeps in flight
+#define LOCAL_PUBLISH_WINDOW 16
+// default size limit of an envelope, when envelopes are enabled
+#define LOCAL_ENVELOPE_BYTES (64 * 1024)
+
+// The local log is split into segment files named after the first sequence they hold. The
+// manifest lists the first sequence of every live segment in order; the last one is the active
+// segment that receives appends. Segments entirely below the publish and commit watermarks are
+// dropped from the manifest and deleted.
+struct LocalManifest {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint64_t segments[];
+};
+
+void encode_local_manifest(struct Buffer *const dest, const struct LocalManifest *src)
+{
+    encode_uint32(dest, src->magic);
+    encode_uint32(dest, src->version);
+    encode_uint32(dest, src->count);
+    for (size_t i = 0; i < src->count; i++) {
+        encode_uint64(dest, src->segments[i]);
+    }
+}
+
+int decode_local_manifest(struct Buffer *const src, struct LocalManifest **dest)
+{
+    int rc;
+    struct LocalManifest *ddest = malloc(sizeof(*ddest));
+    if ((rc = decode_uint32(src, &ddest->magic)) != 0
+        || (rc = decode_uint32(src, &ddest->version)) != 0
+        || (rc = decode_uint32(src, &ddest->count)) != 0) {
+        free(ddest);
+        return rc;
+    }
+
+    ddest = realloc((void *)ddest, sizeof(*ddest) + ddest->count*sizeof(uint64_t));
+    for (size_t i = 0; i < ddest->count; i++) {
+        if ((rc = decode_uint64(src, &ddest->segments[i])) != 0) {
+            free(ddest);
+            return rc;
+        }
+    }
+
+    *dest = ddest;
+    return 0;
+}
+
+struct LocalLog {
+    char *filename;
+    char *client_id;
+    char *address;
+    char *user;
+    char *password;
+    char *topic;
+
+    // header file
+    FILE *fp;
+    sqlite3 *db;
+    sqlite3_stmt *mark_applied;
+    // statements of cql_exec, replay and upstream apply
+    struct StmtCache stmt_cache;
+    // read-only connections for cql_query, if any
+    struct ReadPool *read_pool;
+    // applied watermark written to db, and the part of it that is committed
+    uint64_t next_apply;
+    uint64_t durable_apply;
+
+    // transactions: statements run outside cql_begin are committed every commit_statements
+    // statements or commit_window_ms milliseconds, those inside it on cql_commit
+    int in_transaction;
+    size_t uncommitted;
+    struct timespec uncommitted_since;
+    size_t commit_statements;
+    unsigned int commit_window_ms;
+    // entries of the explicit transaction, they go to the log when it commits
+    struct Buffer *staged;
+    struct Buffer *staged_sizes;
+    size_t staged_entries;
+
+    // writer mode: statements of any thread are queued for a single writer thread
+    int writer_running;
+    pthread_t writer;
+    struct MpscQueue submissions;
+    sem_t submitted;
+    int writer_stop;
+
+    // active segment and its index
+    FILE *segment_fp;
+    FILE *index_fp;
+    // records currently in the index of the active segment
+    uint64_t index_entries;
+    // bytes of entries currently in the active segment
+    uint64_t segment_offset;
+    size_t segment_size;
+
+    // header updates are coalesced to one per header_interval_ms
+    int header_dirty;
+    struct timespec header_written;
+    unsigned int header_interval_ms;
+
+    // group commit: entries and index records appended but not written yet
+    struct Buffer *pending;
+    struct Buffer *pending_index;
+    size_t pending_entries;
+    struct timespec pending_since;
+    size_t group_entries;
+    unsigned int group_window_ms;
+    enum Durability durability;
+
+    // MQTT client kept across cql_publish calls, reconnected with exponential backoff
+    MQTTClient mqtt_client;
+    int mqtt_created;
+    unsigned int reconnect_delay_ms;
+    unsigned int reconnect_min_ms;
+    unsigned int reconnect_max_ms;
+    struct timespec next_reconnect;
+    // last time the broker answered, the session is not trusted after a keepalive without it
+    struct timespec mqtt_active;
+    size_t publish_window;
+    // entries published per message, in an envelope if more than one
+    size_t envelope_entries;
+    size_t envelope_bytes;
+    enum PayloadFormat publish_format;
+    // compression of published payloads, and the dictionary receivers need to decompress them
+    int compress;
+    void *dictionary;
+    uint32_t dictionary_id;
+    struct LzDictionary *lz_dictionary;
+    uint64_t published_messages;
+    uint64_t published_bytes;
+
+    char *index_filename;
+    char *manifest_filename;
+    struct LocalManifest *manifest;
+
+    struct LocalLogHeader *header;
+};
+
+void local_log_init(struct LocalLog *const local_log)
+{
+    local_log->filename = NULL;
+    local_log->client_id = NULL;
+    local_log->address = NULL;
+    local_log->user = NULL;
+    local_log->password = NULL;
+    local_log->topic = NULL;
+
+    local_log->fp = NULL;
+    local_log->db = NULL;
+    local_log->mark_applied = NULL;
+    stmt_cache_init(&local_log->stmt_cache, NULL, LOCAL_STMT_CACHE_SIZE);
+    local_log->read_pool = NULL;
+    local_log->next_apply = 0;
+    local_log->durable_apply = 0;
+
+    local_log->in_transaction = 0;
+    local_log->uncommitted = 0;
+    local_log->commit_statements = 1;
+    local_log->commit_window_ms = 0;
+    local_log->staged = malloc(sizeof(*local_log->staged));
+    buffer_init(local_log->staged);
+    local_log->staged_sizes = malloc(sizeof(*local_log->staged_sizes));
+    buffer_init(local_log->staged_sizes);
+    local_log->staged_entries = 0;
+
+    local_log->writer_running = 0;
+    local_log->writer_stop = 0;
+
+    local_log->segment_fp = NULL;
+    local_log->index_fp = NULL;
+    local_log->index_entries = 0;
+    local_log->segment_offset = 0;
+    local_log->segment_size = LOCAL_SEGMENT_SIZE;
+
+    local_log->header_dirty = 0;
+    local_log->header_written.tv_sec = 0;
+    local_log->header_written.tv_nsec = 0;
+    local_log->header_interval_ms = 0;
+
+    local_log->pending = malloc(sizeof(*local_log->pending));
+    buffer_init(local_log->pending);
+    local_log->pending_index = malloc(sizeof(*local_log->pending_index));
+    buffer_init(local_log->pending_index);
+    local_log->pending_entries = 0;
+    local_log->group_entries = 1;
+    local_log->group_window_ms = 0;
+    local_log->durability = DurabilityWrite;
+
+    local_log->mqtt_client = NULL;
+    local_log->mqtt_created = 0;
+    local_log->reconnect_delay_ms = 0;
+    local_log->reconnect_min_ms = LOCAL_MQTT_RECONNECT_MIN_MS;
+    local_log->reconnect_max_ms = LOCAL_MQTT_RECONNECT_MAX_MS;
+    local_log->next_reconnect.tv_sec = 0;
+    local_log->next_reconnect.tv_nsec = 0;
+    local_log->mqtt_active.tv_sec = 0;
+    local_log->mqtt_active.tv_nsec = 0;
+    local_log->publish_window = LOCAL_PUBLISH_WINDOW;
+    local_log->envelope_entries = 1;
+    local_log->envelope_bytes = LOCAL_ENVELOPE_BYTES;
+    local_log->publish_format = PayloadJson;
+    local_log->compress = 0;
+    local_log->dictionary = NULL;
+    local_log->dictionary_id = 0;
+    local_log->lz_dictionary = NULL;
+    local_log->published_messages = 0;
+    local_log->published_bytes = 0;
+
+    local_log->index_filename = NULL;
+    local_log->manifest_filename = NULL;
+    local_log->manifest = NULL;
 
     local_log->header = NULL;
 }
 
 void local_log_free(struct LocalLog *const local_log)
 {
+    if (local_log->writer_running) {
+        local_log_stop_writer(local_log);
+    }
+    // An open explicit transaction is abandoned, statements run outside of one are kept
+    if (local_log->segment_fp != NULL && local_log->db != NULL) {
+        if (local_log->in_transaction) {
+            cql_rollback(local_log, NULL);
+        } else if (local_log->uncommitted > 0 && cql_commit(local_log, NULL) != SQLITE_OK) {
+            printf("failed to commit pending statements\n");
+        }
+    }
+    if (local_log->segment_fp != NULL && local_log_sync(local_log) != 0) {
+        printf("failed to write pending local log entries\n");
+    }
+    buffer_free(local_log->pending);
+    buffer_free(local_log->pending_index);
+    buffer_free(local_log->staged);
+    buffer_free(local_log->staged_sizes);
+
     free(local_log->filename);
     free(local_log->client_id);
     free(local_log->address);
     free(local_log->user);
     free(local_log->password);
     free(local_log->topic);
+    free(local_log->dictionary);
+    free(local_log->lz_dictionary);
 
-    fclose(local_log->fp);
+    if (local_log->fp != NULL) {
+        fclose(local_log->fp);
+    }
+    if (local_log->read_pool != NULL) {
+        read_pool_close(local_log->read_pool);
+        free(local_log->read_pool);
+    }
+    stmt_cache_free(&local_log->stmt_cache);
+    sqlite3_finalize(local_log->mark_applied);
     sqlite3_close(local_log->db);
 
+    if (local_log->segment_fp != NULL) {
+        fclose(local_log->segment_fp);
+    }
+    if (local_log->index_fp != NULL) {
+        fclose(local_log->index_fp);
+    }
+
+    if (local_log->mqtt_created) {
+        if (MQTTClient_isConnected(local_log->mqtt_client)) {
+            MQTTClient_disconnect(local_log->mqtt_client, 1000);
+        }
+        MQTTClient_destroy(&local_log->mqtt_client);
+    }
+
+    free(local_log->index_filename);
+    free(local_log->manifest_filename);
+    free(local_log->manifest);
+
     free(local_log->header);
 
     free(local_log);
 }
 
+void local_log_set_segment_size(struct LocalLog *const local_log, size_t segment_size)
+{
+    local_log->segment_size = segment_size;
+}
+
+void local_log_set_durability(struct LocalLog *const local_log, enum Durability durability)
+{
+    local_log->durability = durability;
+}
+
+// Let local_log_append collect up to max_entries entries, or the entries of window_ms
+// milliseconds, before writing them with a single header update. The window is checked on
+// append, so callers that go idle should call local_log_sync.
+void local_log_set_group_commit(struct LocalLog *const local_log,
+                                size_t max_entries, unsigned int window_ms)
+{
+    local_log->group_entries = max_entries > 0 ? max_entries : 1;
+    local_log->group_window_ms = window_ms;
+}
+
+// Write the header at most once per interval_ms. Appends and publish acknowledgements past the
+// last written header are recovered from the segments on open; publish may then resend a few
+// entries, which upstream deduplicates by sequence.
+void local_log_set_header_interval(struct LocalLog *const local_log, unsigned int interval_ms)
+{
+    local_log->header_interval_ms = interval_ms;
+}
+
+// Commit the statements run outside of cql_begin every max_statements statements, or those of
+// window_ms milliseconds. Each commit first writes the entries of those statements to the local
+// log, so committing along with the group commit of the local log keeps the two in step. The
+// window is checked when a statement runs, callers that go idle should call cql_commit.
+void local_log_set_auto_commit(struct LocalLog *const local_log,
+                               size_t max_statements, unsigned int window_ms)
+{
+    local_log->commit_statements = max_statements > 0 ? max_statements : 1;
+    local_log->commit_window_ms = window_ms;
+}
+
+// Wait at least min_ms before reconnecting to the broker after a failure, doubling the delay
+// after each failed attempt up to max_ms.
+void local_log_set_reconnect_backoff(struct LocalLog *const local_log,
+                                     unsigned int min_ms, unsigned int max_ms)
+{
+    local_log->reconnect_min_ms = min_ms;
+    local_log->reconnect_max_ms = max_ms > min_ms ? max_ms : min_ms;
+}
+
+// Let cql_publish keep up to window messages in flight instead of waiting for each to be
+// acknowledged before sending the next. The broker connection is made again for a new window.
+void local_log_set_publish_window(struct LocalLog *const local_log, size_t window)
+{
+    window = window > 0 ? window : 1;
+    if (window != local_log->publish_window && local_log->mqtt_created
+        && MQTTClient_isConnected(local_log->mqtt_client)) {
+        MQTTClient_disconnect(local_log->mqtt_client, 1000);
+    }
+    local_log->publish_window = window;
+}
+
+// Let cql_publish pack up to max_entries consecutive entries into one envelope message, as long
+// as it stays within max_bytes bytes; an entry larger than that still goes out alone. With
+// max_entries 1, the default, each entry is published on its own, without an envelope.
+void local_log_set_publish_envelope(struct LocalLog *const local_log,
+                                    size_t max_entries, size_t max_bytes)
+{
+    local_log->envelope_entries = max_entries > 0 ? max_entries : 1;
+    local_log->envelope_bytes = max_bytes > 0 ? max_bytes : LOCAL_ENVELOPE_BYTES;
+}
+
+// Choose how cql_publish encodes entries. Binary payloads hold the entries as they are in the
+// local log, so they go out without being encoded again; a subscriber tells them from JSON by
+// their marker. Envelope limits apply to both.
+void local_log_set_publish_format(struct LocalLog *const local_log, enum PayloadFormat format)
+{
+    local_log->publish_format = format;
+}
+
+// Compress published payloads when it makes them smaller, with an optional dictionary of text
+// they are likely to share, such as what local_log_build_dictionary gathers. The dictionary is
+// copied. Receivers need the same one to decompress, the payload names it by its CRC-32.
+void local_log_set_publish_compression(struct LocalLog *const local_log, int enabled,
+                                       const void *dictionary, size_t size)
+{
+    free(local_log->dictionary);
+    free(local_log->lz_dictionary);
+    local_log->compress = enabled;
+    local_log->dictionary = NULL;
+    local_log->dictionary_id = 0;
+    local_log->lz_dictionary = NULL;
+    if (dictionary == NULL || size == 0) {
+        return;
+    }
+    local_log->dictionary = malloc(size);
+    memcpy(local_log->dictionary, dictionary, size);
+    local_log->dictionary_id = checksum_crc32(dictionary, size);
+    local_log->lz_dictionary = malloc(sizeof(*local_log->lz_dictionary));
+    lz_dictionary_init(local_log->lz_dictionary, local_log->dictionary, size);
+}
+
+// Report the number of messages handed to the MQTT client and the bytes of their PUBLISH
+// packets. A message sent again after a failure counts again, as it goes over the wire again.
+void local_log_publish_stats(const struct LocalLog *local_log, uint64_t *messages, uint64_t *bytes)
+{
+    *messages = local_log->published_messages;
+    *bytes = local_log->published_bytes;
+}
+
+// Push a file to the given durability level.
+int sync_file(FILE *fp, enum Durability durability)
+{
+    int rc = 0;
+    if (durability >= DurabilityWrite) {
+        rc = fflush(fp);
+    }
+    if (rc == 0 && durability >= DurabilityFdatasync) {
+        rc = fdatasync(fileno(fp));
+    }
+    return rc;
+}
+
 int open_and_init_db(const char *filename, sqlite3 **dest)
 {
     sqlite3* db;
     char *err_msg = 0;
 
-    int rc = sqlite3_enable_shared_cache(1);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "cannot enable shared cache: %s\n", sqlite3_errstr(rc));
-        return 1;
-    }
-
-    rc = sqlite3_open(filename, &db);
+    int rc = sqlite3_open(filename, &db);
     if (rc != SQLITE_OK) {
         fprintf(stderr, "cannot open database: %s\n", sqlite3_errmsg(db));
         sqlite3_close(db);
         return 1;
     }
 
-    char *init = "PRAGMA journal_mode=WAL;"
-                 "PRAGMA read_uncommitted=1;"
-                 "BEGIN TRANSACTION;";
+    // WAL lets the connections of the read pool query while this one writes
+    char *init = "PRAGMA journal_mode=WAL;";
     rc = sqlite3_exec(db, init, 0, 0, &err_msg);
     if (rc != SQLITE_OK) {
         fprintf(stderr, "sql error: %s\n", err_msg);
@@ -710,460 +1563,2909 @@ int open_and_init_db(const char *filename, sqlite3 **dest)
     return 0;
 }
 
-int cql_open(
-    const char *filename,
-    const char *client_id,
-    const char *address,
-    const char *user,
-    const char *password,
-    const char *topic,
-    struct LocalLog **dest)
+// The applied watermark is the next log sequence whose statements have not been applied to the
+// database yet. It lives in the database itself, so it is updated in the same transaction as the
+// statements it covers and can never run ahead of (or fall behind) the data.
+int init_applied_watermark(struct LocalLog *const local_log, uint64_t *next_apply)
 {
     int rc;
+    char *err_msg = NULL;
+    sqlite3_stmt *stmt = NULL;
 
-    struct LocalLog *ddest = malloc(sizeof(*ddest));
-    local_log_init(ddest);
+    char *init = "CREATE TABLE IF NOT EXISTS __cql_local_meta (key TEXT PRIMARY KEY, value INTEGER NOT NULL);"
+                 "INSERT OR IGNORE INTO __cql_local_meta (key, value) VALUES ('next_apply', 0);";
+    rc = sqlite3_exec(local_log->db, init, 0, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "sql error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        return 1;
+    }
 
-    ddest->filename = malloc(strlen(filename) + strlen("-loc") + 1);
-    strcpy(ddest->filename, filename);
-    strcat(ddest->filename, "-loc");
+    rc = sqlite3_prepare_v2(local_log->db,
+                            "SELECT value FROM __cql_local_meta WHERE key = 'next_apply';",
+                            -1, &stmt, NULL);
+    if (rc != SQLITE_OK || (rc = sqlite3_step(stmt)) != SQLITE_ROW) {
+        fprintf(stderr, "cannot load applied watermark: %s\n", sqlite3_errmsg(local_log->db));
+        sqlite3_finalize(stmt);
+        return 1;
+    }
+    *next_apply = (uint64_t)sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
 
-    ddest->client_id = strdup(client_id);
-    ddest->address = strdup(address);
-    ddest->user = strdup(user);
-    ddest->password = strdup(password);
-    ddest->topic = strdup(topic);
+    rc = sqlite3_prepare_v2(local_log->db,
+                            "UPDATE __cql_local_meta SET value = ? WHERE key = 'next_apply';",
+                            -1, &local_log->mark_applied, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "cannot prepare applied watermark: %s\n", sqlite3_errmsg(local_log->db));
+        return 1;
+    }
+    return 0;
+}
 
-    // open db file
-    if ((rc = open_and_init_db(filename, &ddest->db)) != 0) {
-        local_log_free(ddest);
+int mark_applied(struct LocalLog *const local_log, uint64_t next_apply)
+{
+    int rc;
+    sqlite3_bind_int64(local_log->mark_applied, 1, (sqlite3_int64)next_apply);
+    rc = sqlite3_step(local_log->mark_applied);
+    sqlite3_reset(local_log->mark_applied);
+    if (rc != SQLITE_DONE) {
         return rc;
     }
+    local_log->next_apply = next_apply;
+    return SQLITE_OK;
+}
 
-    struct Buffer *buffer = malloc(sizeof(*buffer));
-    buffer_init(buffer);
-
-    if (access(ddest->filename, F_OK) != 0) {
-        // File does not exist, initialize header
-        ddest->header = malloc(sizeof(*(ddest->header)));
-        ddest->header->magic = LOCAL_LOG_MAGIC;
-        ddest->header->version= LOCAL_LOG_VERSION;
-        ddest->header->block_id= 0;
-        ddest->header->block_index = 0;
-        ddest->header->sequence = 0;
-        ddest->header->entries = 0;
-        // TODO(leventeliu): randomize salt and calculate checksum.
-        ddest->header->salt= 0;
-        ddest->header->checksum = 0;
-
-        // Create file and write header
-        ddest->fp = fopen(ddest->filename, "w+b");
-        if (ddest->fp == NULL) {
-            buffer_free(buffer);
-            local_log_free(ddest);
-            return -1;
-        }
-
-        buffer->fp = ddest->fp;
-        encode_local_log_header(buffer, ddest->header);
-        rc = buffer_flush(buffer);
-        if (rc != 0) {
-            buffer_free(buffer);
-            local_log_free(ddest);
-            return -1;
-        }
-    } else {
-        ddest->fp = fopen(ddest->filename, "r+b");
-        if (ddest->fp == NULL) {
-            printf("failed to open file: io error\n");
-            buffer_free(buffer);
-            local_log_free(ddest);
-            return -1;
-        }
-        buffer->fp = ddest->fp;
-
-        // Read header
-        rc = decode_local_log_header(buffer, &ddest->header);
-        if (rc != 0) {
-            printf("failed to decode header\n");
-            buffer_free(buffer);
-            local_log_free(ddest);
-            return -1;
-        }
+// Name of the segment (or segment index) file starting at first_seq.
+char *segment_filename(const char *prefix, uint64_t first_seq)
+{
+    char *filename = malloc(strlen(prefix) + 18);
+    sprintf(filename, "%s-%016" PRIx64, prefix, first_seq);
+    return filename;
+}
 
-        printf("local log header: magic = %" PRIx32 " version = %" PRIx32 " seq = %" PRId64
-               " entries = %" PRId32"\n",
-               ddest->header->magic,
-               ddest->header->version,
-               ddest->header->sequence,
-               ddest->header->entries);
+uint64_t segment_first(const struct LocalLog *local_log, size_t segment)
+{
+    return local_log->manifest->segments[segment];
+}
 
-        // TODO(leventeliu): verify header.
+uint64_t segment_end(const struct LocalLog *local_log, size_t segment)
+{
+    if (segment + 1 < local_log->manifest->count) {
+        return local_log->manifest->segments[segment + 1];
+    }
+    return local_log->header->sequence;
+}
 
-        // Read and replay entries
-        struct LogEntry *entry;
-        char *errmsg = NULL;
-        for (size_t i = 0; i < ddest->header->entries; i++) {
-            rc = decode_log_entry(buffer, &entry);
-            if (rc != 0) {
-                printf("failed to decode entry at #%zd\n", i);
-                buffer_free(buffer);
-                local_log_free(ddest);
-                return -1;
-            }
-            printf("read log entry from local log: block_id = %" PRIu64 " block_index = %" PRIu64
-                   " seq = %" PRId64 " pattern = %s\n",
-                   entry->block_id,
-                   entry->block_index,
-                   entry->seq,
-                   entry->events[0]->pattern);
-            rc = sqlite3_exec(ddest->db, entry->events[0]->pattern, NULL, NULL, &errmsg);
-            if (rc != SQLITE_OK) {
-                fprintf(stderr, "sql error: %s\n", errmsg);
-                sqlite3_free(errmsg);
-                buffer_free(buffer);
-                local_log_free(ddest);
-                return 1;
-            }
-            // TODO(leventeliu): verify entries.
-            sqlite3_free(errmsg);
-            log_entry_free(entry);
+// Find the segment holding the given sequence.
+size_t segment_of(const struct LocalLog *local_log, uint64_t seq)
+{
+    size_t lo = 0;
+    size_t hi = local_log->manifest->count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (local_log->manifest->segments[mid] <= seq) {
+            lo = mid;
+        } else {
+            hi = mid;
         }
     }
-
-    buffer_free(buffer);
-    *dest = ddest;
-    return 0;
+    return lo;
 }
 
-int local_log_append(struct LocalLog *const local_log, struct LogEntry *log_entry)
+int local_index_append(FILE *index_fp, uint64_t record, uint64_t offset)
 {
     int rc;
     struct Buffer *buffer = malloc(sizeof(*buffer));
     buffer_init(buffer);
-    buffer->fp = local_log->fp;
+    buffer->fp = index_fp;
 
-    // Append log entry
-    log_entry->seq = local_log->header->sequence; // overwrite sequence number
-    encode_log_entry(buffer, log_entry);
-    rc = buffer_flush(buffer);
+    rc = fseek(index_fp, LOCAL_INDEX_HEADER_SIZE + record*LOCAL_INDEX_RECORD_SIZE, SEEK_SET);
     if (rc != 0) {
         buffer_free(buffer);
         return rc;
     }
-
-    // Update header
-    //
-    // TODO(leventeliu): randomize salt and calculate checksum.
-    local_log->header->entries++;
-    local_log->header->sequence++;
-    rc = fseek(local_log->fp, 0, SEEK_SET);
-    encode_local_log_header(buffer, local_log->header);
+    encode_uint64(buffer, offset);
     rc = buffer_flush(buffer);
     buffer_free(buffer);
-
     if (rc != 0) {
         return rc;
     }
-
-    rc = fseek(local_log->fp, 0, SEEK_END);
-    return rc;
+    return fflush(index_fp);
 }
 
-int local_log_merge(
-    struct LocalLog *const local_log,
-    struct LogEntry *upstream[], size_t upstream_size,
-    struct LogEntry ***merged, size_t *merged_size, size_t *commit_point)
+int local_index_lookup(FILE *index_fp, uint64_t record, uint64_t *offset)
 {
     int rc;
-
-    // Load local log entires
-    rc = fseek(local_log->fp, 0, SEEK_SET);
+    rc = fseek(index_fp, LOCAL_INDEX_HEADER_SIZE + record*LOCAL_INDEX_RECORD_SIZE, SEEK_SET);
     if (rc != 0) {
         return rc;
     }
-
-    // Read header
     struct Buffer *buffer = malloc(sizeof(*buffer));
     buffer_init(buffer);
+    buffer->fp = index_fp;
+    rc = decode_uint64(buffer, offset);
+    buffer_free(buffer);
+    return rc;
+}
 
-    rc = decode_local_log_header(buffer, &local_log->header);
-    if (rc != 0) {
-        printf("failed to decode header\n");
-        buffer_free(buffer);
-        return -1;
-    }
-
-    printf("local log header: magic = %" PRIx32 " version = %" PRIx32 " seq = %" PRId64
-           " entries = %" PRId32"\n",
-           local_log->header->magic,
-           local_log->header->version,
-           local_log->header->sequence,
-           local_log->header->entries);
+// Index the entries of a segment from record *index_entries up to entries by scanning the
+// segment, starting right after the last entry that is already indexed.
+int local_index_rebuild(FILE *index_fp, uint64_t *index_entries, FILE *segment_fp, uint64_t entries)
+{
+    int rc;
+    uint64_t offset = 0;
+    struct LogEntry *entry;
 
-    // Read entries
-    struct LogEntry **local_log_entries = malloc((size_t)local_log->header->entries * sizeof(void *));
-    for (size_t i = 0; i < local_log->header->entries; i++) {
-        local_log_entries[i] = NULL;
+    if (*index_entries > 0) {
+        if ((rc = local_index_lookup(index_fp, *index_entries - 1, &offset)) != 0) {
+            return rc;
+        }
     }
-
-    for (size_t i = 0; i < local_log->header->entries; i++) {
-        rc = decode_log_entry(buffer, &local_log_entries[i]);
-        if (rc != 0) {
-            printf("failed to decode entry at #%zd\n", i);
+    struct Buffer *buffer = malloc(sizeof(*buffer));
+    buffer_init(buffer);
+    if ((rc = buffer_map(buffer, segment_fp)) != 0 || offset > buffer->offset) {
+        buffer_free(buffer);
+        return -1;
+    }
+    buffer->read_p = (size_t)offset;
+    struct Arena arena;
+    arena_init(&arena, LOCAL_LOG_ARENA_BLOCK_SIZE);
+
+    if (*index_entries > 0) {
+        // skip the last indexed entry
+        if ((rc = decode_log_entry(buffer, &arena, &entry)) != 0) {
+            arena_free(&arena);
             buffer_free(buffer);
-            for (size_t i = 0; i < local_log->header->entries; i++) {
-                log_entry_free(local_log_entries[i]);
-            }
-            free(local_log_entries);
-            return 1;
+            return rc;
         }
-        printf("read log entry from local log: block_id = %" PRIu64 " block_index = %" PRIu64 "\n",
-               local_log_entries[i]->block_id,
-               local_log_entries[i]->block_index);
+        arena_reset(&arena);
+    }
+    while (*index_entries < entries) {
+        uint64_t entry_offset = buffer_position(buffer);
+        if ((rc = decode_log_entry(buffer, &arena, &entry)) != 0) {
+            printf("failed to decode entry at #%" PRIu64 "\n", *index_entries);
+            arena_free(&arena);
+            buffer_free(buffer);
+            return rc;
+        }
+        arena_reset(&arena);
+        if ((rc = local_index_append(index_fp, *index_entries, entry_offset)) != 0) {
+            arena_free(&arena);
+            buffer_free(buffer);
+            return rc;
+        }
+        (*index_entries)++;
     }
-    buffer_free(buffer);
 
-    // Start merge
-    struct LogEntry **dmerged = malloc((size_t)(local_log->header->entries + upstream_size)*sizeof(void *));
-    size_t local_pos = 0;
-    size_t ups_pos = 0;
-    size_t merged_pos = 0;
+    arena_free(&arena);
+    buffer_free(buffer);
+    return 0;
+}
 
-    while (ups_pos < upstream_size && (
-               upstream[ups_pos]->block_id < local_log->header->block_id ||
-               (upstream[ups_pos]->block_id == local_log->header->block_id &&
-                upstream[ups_pos]->block_index <= local_log->header->block_index))) {
-        printf("upstream log entry is older than local: upstream = %" PRId64 ":%" PRId64
-               " local = %" PRId64 ":%" PRId64,
-               upstream[ups_pos]->block_id,
-               upstream[ups_pos]->block_index,
-               local_log->header->block_id,
-               local_log->header->block_index);
-        log_entry_free(upstream[ups_pos]);
-        ups_pos++;
-    }
+// Open the index file of a segment, recreating it if it is missing or does not belong to the
+// segment, and bring it in line with the number of entries the segment holds.
+int local_index_open(const char *filename, uint64_t first_seq, uint64_t entries,
+                     FILE *segment_fp, FILE **index_fp, uint64_t *index_entries)
+{
+    int rc;
+    struct LocalIndexHeader index_header;
+    struct Buffer *buffer = malloc(sizeof(*buffer));
+    buffer_init(buffer);
 
-    while (ups_pos < upstream_size) {
-        if (strcmp(local_log->client_id, upstream[ups_pos]->client_id) == 0) {
-            while (local_pos < local_log->header->entries &&
-                   local_log_entries[local_pos]->seq < upstream[ups_pos]->seq) {
-                printf("upstream log entry appears to be greater than local,"
-                       " maybe be skipped by miner: upstream = %s:%" PRId64
-                       " local = %s:%" PRId64,
-                       upstream[ups_pos]->client_id, upstream[ups_pos]->seq,
-                       local_log->client_id,
-                       local_log_entries[local_pos]->seq);
-                log_entry_free(local_log_entries[local_pos++]); // free discarded object in local_log_entries
-            }
-            // match not found
-            if (local_pos >= local_log->header->entries) {
-                printf("upstream log entry matches local client_id,"
-                       " but cannot be found in local log, abort merging"
-                       " upstream = %s:%" PRId64 ", abort",
-                       upstream[ups_pos]->client_id, upstream[ups_pos]->seq);
-                // TODO(leventeliu): free objects.
-                return 1;
-            }
-            if (local_log_entries[local_pos]->seq > upstream[ups_pos]->seq) {
-                printf("upstream log entry matches local client_id,"
-                       " but local sequence number is greater, abort merging"
-                       " upstream = %s:%" PRId64 ", abort",
-                       upstream[ups_pos]->client_id, upstream[ups_pos]->seq);
-                // TODO(leventeliu): free objects.
-                return 1;
+    FILE *fp = fopen(filename, "r+b");
+    uint64_t count = 0;
+    if (fp != NULL) {
+        buffer->fp = fp;
+        rc = decode_local_index_header(buffer, &index_header);
+        if (rc == 0
+            && index_header.magic == LOCAL_INDEX_MAGIC
+            && index_header.version == LOCAL_INDEX_VERSION
+            && index_header.first_seq == first_seq
+            && fseek(fp, 0, SEEK_END) == 0) {
+            long size = ftell(fp);
+            if (size >= LOCAL_INDEX_HEADER_SIZE) {
+                count = (uint64_t)(size - LOCAL_INDEX_HEADER_SIZE) / LOCAL_INDEX_RECORD_SIZE;
             }
-            // matched
-            log_entry_free(local_log_entries[local_pos++]); // free duplicate object in local_log_entries
-            dmerged[merged_pos++] = upstream[ups_pos];      // move from upstream to merged list
         } else {
-            // unknown client source, move from upstream to merged list directly
-            dmerged[merged_pos++] = upstream[ups_pos];
+            printf("stale local log index %s, rebuild\n", filename);
+            fclose(fp);
+            fp = NULL;
         }
-        ups_pos++;
     }
 
-    // move remaining objects in local_log_entries
-    *commit_point = merged_pos; // committed logs by chain
-    while (local_pos < local_log->header->entries) {
-        dmerged[merged_pos++] = local_log_entries[local_pos];
-        local_pos++;
+    if (fp == NULL) {
+        fp = fopen(filename, "w+b");
+        if (fp == NULL) {
+            printf("failed to create index file: io error\n");
+            buffer_free(buffer);
+            return -1;
+        }
+        index_header.magic = LOCAL_INDEX_MAGIC;
+        index_header.version = LOCAL_INDEX_VERSION;
+        index_header.first_seq = first_seq;
+        buffer_free(buffer);
+        buffer = malloc(sizeof(*buffer));
+        buffer_init(buffer);
+        buffer->fp = fp;
+        encode_local_index_header(buffer, &index_header);
+        if ((rc = buffer_flush(buffer)) != 0) {
+            buffer_free(buffer);
+            fclose(fp);
+            return rc;
+        }
     }
-    *merged = dmerged;
-    *merged_size = merged_pos;
+    buffer_free(buffer);
+
+    if (count > entries) {
+        // Records past the end of the segment were written by an append that never completed
+        count = entries;
+        if ((rc = fflush(fp)) != 0
+            || (rc = ftruncate(fileno(fp),
+                               (off_t)(LOCAL_INDEX_HEADER_SIZE + count*LOCAL_INDEX_RECORD_SIZE))) != 0) {
+            fclose(fp);
+            return rc;
+        }
+    }
+    if (count < entries && (rc = local_index_rebuild(fp, &count, segment_fp, entries)) != 0) {
+        fclose(fp);
+        return rc;
+    }
+
+    *index_fp = fp;
+    *index_entries = count;
     return 0;
 }
 
-int cql_exec(struct LocalLog *const local_log, const char *sql,
-             int (*callback) (void *, int, char **, char **), void *arg, char **errmsg)
+int local_log_write_header(struct LocalLog *const local_log)
 {
     int rc;
     struct Buffer *buffer = malloc(sizeof(*buffer));
     buffer_init(buffer);
-    struct Event *event = malloc(sizeof(*event));
-    event_init(event);
-    event->pattern = strdup(sql);
-    struct LogEntry *entry = malloc(sizeof(*entry) + 1*sizeof(void *));
-    log_entry_init(entry);
-    entry->client_id = strdup(local_log->client_id);
-    entry->seq = local_log->header->sequence;
-    entry->count = 1;
-    entry->events[0] = event;
+    buffer->fp = local_log->fp;
 
-    rc = sqlite3_exec(local_log->db, sql, callback, arg, errmsg);
-    if (rc != SQLITE_OK) {
+    local_log->header->generation++;
+    rc = fseek(local_log->fp, (long)(local_log->header->generation % 2)*LOCAL_LOG_SLOT_SIZE, SEEK_SET);
+    if (rc != 0) {
+        buffer_free(buffer);
+        return rc;
+    }
+    encode_local_log_header(buffer, local_log->header);
+    rc = buffer_flush(buffer);
+    buffer_free(buffer);
+    if (rc != 0) {
         return rc;
     }
+    local_log->header_dirty = 0;
+    clock_gettime(CLOCK_MONOTONIC, &local_log->header_written);
+    return sync_file(local_log->fp, local_log->durability);
+}
 
-    rc = local_log_append(local_log, entry);
-    if (rc != 0 && errmsg != NULL) {
-        *errmsg = strdup("failed to append local log");
+// Write the header unless the last write is more recent than the header interval.
+int local_log_update_header(struct LocalLog *const local_log)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t elapsed_ms = (int64_t)(now.tv_sec - local_log->header_written.tv_sec)*1000
+        + (now.tv_nsec - local_log->header_written.tv_nsec)/1000000;
+    if (elapsed_ms < (int64_t)local_log->header_interval_ms) {
+        local_log->header_dirty = 1;
+        return 0;
+    }
+    return local_log_write_header(local_log);
+}
+
+// Read both header slots and keep the newest valid one.
+int local_log_read_header(struct LocalLog *const local_log)
+{
+    struct LocalLogHeader *slots[2] = { NULL, NULL };
+    for (int i = 0; i < 2; i++) {
+        if (fseek(local_log->fp, (long)i*LOCAL_LOG_SLOT_SIZE, SEEK_SET) != 0) {
+            continue;
+        }
+        struct Buffer *buffer = malloc(sizeof(*buffer));
+        buffer_init(buffer);
+        buffer->fp = local_log->fp;
+        if (decode_local_log_header(buffer, &slots[i]) != 0) {
+            printf("local log header slot %d is invalid\n", i);
+            slots[i] = NULL;
+        }
+        buffer_free(buffer);
+    }
+
+    int current = slots[1] != NULL && (slots[0] == NULL || slots[1]->generation > slots[0]->generation);
+    if (slots[current] == NULL) {
+        return -1;
+    }
+    local_log->header = slots[current];
+    free(slots[1 - current]);
+    return 0;
+}
+
+// Replace the manifest file atomically with the in-memory manifest.
+int local_manifest_write(struct LocalLog *const local_log)
+{
+    int rc;
+    char *tmpname = malloc(strlen(local_log->manifest_filename) + strlen(".tmp") + 1);
+    strcpy(tmpname, local_log->manifest_filename);
+    strcat(tmpname, ".tmp");
+
+    FILE *fp = fopen(tmpname, "wb");
+    if (fp == NULL) {
+        printf("failed to create manifest: io error\n");
+        free(tmpname);
+        return -1;
+    }
+    struct Buffer *buffer = malloc(sizeof(*buffer));
+    buffer_init(buffer);
+    buffer->fp = fp;
+    encode_local_manifest(buffer, local_log->manifest);
+    rc = buffer_flush(buffer);
+    buffer_free(buffer);
+    if (rc != 0 || (rc = fflush(fp)) != 0 || (rc = fsync(fileno(fp))) != 0) {
+        fclose(fp);
+        free(tmpname);
+        return -1;
     }
+    fclose(fp);
 
+    rc = rename(tmpname, local_log->manifest_filename);
+    free(tmpname);
     return rc;
 }
 
-int cql_publish(struct LocalLog *const local_log)
+// Open (or create) the active segment starting at first_seq and its index.
+int local_log_open_segment(struct LocalLog *const local_log, uint64_t first_seq, uint64_t entries)
 {
     int rc;
+    char *name = segment_filename(local_log->filename, first_seq);
+    local_log->segment_fp = fopen(name, "r+b");
+    if (local_log->segment_fp == NULL && entries == 0) {
+        local_log->segment_fp = fopen(name, "w+b");
+    }
+    free(name);
+    if (local_log->segment_fp == NULL) {
+        printf("failed to open segment %016" PRIx64 ": io error\n", first_seq);
+        return -1;
+    }
 
-    // Load local log entires
-    rc = fseek(local_log->fp, 0, SEEK_SET);
+    name = segment_filename(local_log->index_filename, first_seq);
+    rc = local_index_open(name, first_seq, entries,
+                          local_log->segment_fp, &local_log->index_fp, &local_log->index_entries);
+    free(name);
     if (rc != 0) {
         return rc;
     }
 
-    // Read header
+    // Find the end of the last entry. Entries past it that carry the expected sequences were
+    // appended after the last header write and are indexed again, whatever follows them was left
+    // behind by an interrupted group and is cut off.
+    uint64_t offset = 0;
+    if (local_log->index_entries > 0
+        && (rc = local_index_lookup(local_log->index_fp, local_log->index_entries - 1, &offset)) != 0) {
+        return rc;
+    }
     struct Buffer *buffer = malloc(sizeof(*buffer));
     buffer_init(buffer);
-
-    rc = decode_local_log_header(buffer, &local_log->header);
-    if (rc != 0) {
-        printf("failed to decode header\n");
+    if ((rc = buffer_map(buffer, local_log->segment_fp)) != 0 || offset > buffer->offset) {
         buffer_free(buffer);
         return -1;
     }
-
-    printf("local log header: magic = %" PRIx32 " version = %" PRIx32 " seq = %" PRId64
-           " entries = %" PRId32"\n",
-           local_log->header->magic,
-           local_log->header->version,
-           local_log->header->sequence,
-           local_log->header->entries);
-
-    // Read entries
-    struct LogEntry **local_log_entries = malloc((size_t)local_log->header->entries * sizeof(void *));
-    for (size_t i = 0; i < local_log->header->entries; i++) {
-        local_log_entries[i] = NULL;
+    uint64_t size = buffer->offset;
+    buffer->read_p = (size_t)offset;
+    struct LogEntry *entry;
+    struct Arena arena;
+    arena_init(&arena, LOCAL_LOG_ARENA_BLOCK_SIZE);
+    if (local_log->index_entries > 0) {
+        if ((rc = decode_log_entry(buffer, &arena, &entry)) != 0) {
+            arena_free(&arena);
+            buffer_free(buffer);
+            return rc;
+        }
+        arena_reset(&arena);
     }
-
-    for (size_t i = 0; i < local_log->header->entries; i++) {
-        rc = decode_log_entry(buffer, &local_log_entries[i]);
-        if (rc != 0) {
-            printf("failed to decode entry at #%zd\n", i);
+    uint64_t end = buffer_position(buffer);
+    while (end < size && decode_log_entry(buffer, &arena, &entry) == 0) {
+        int expected = entry->seq == first_seq + local_log->index_entries;
+        arena_reset(&arena);
+        if (!expected) {
+            break;
+        }
+        if ((rc = local_index_append(local_log->index_fp, local_log->index_entries, end)) != 0) {
+            arena_free(&arena);
             buffer_free(buffer);
-            for (size_t i = 0; i < local_log->header->entries; i++) {
-                log_entry_free(local_log_entries[i]);
-            }
-            free(local_log_entries);
-            return 1;
+            return rc;
         }
-        printf("read log entry from local log: block_id = %" PRIu64 " block_index = %" PRIu64 "\n",
-               local_log_entries[i]->block_id,
-               local_log_entries[i]->block_index);
+        local_log->index_entries++;
+        end = buffer_position(buffer);
     }
+    arena_free(&arena);
     buffer_free(buffer);
+    offset = end;
 
-    // initialize mqtt client for publish
-    MQTTClient client;
-    MQTTClient_connectOptions opts = MQTTClient_connectOptions_initializer;
-    MQTTClient_message msg = MQTTClient_message_initializer;
-    MQTTClient_deliveryToken token;
-    MQTTClient_create(&client, local_log->address, local_log->client_id,
-                      MQTTCLIENT_PERSISTENCE_NONE, NULL);
+    if (size > offset) {
+        printf("truncate segment %016" PRIx64 " to %" PRIu64 "\n", first_seq, offset);
+        if ((rc = fflush(local_log->segment_fp)) != 0
+            || (rc = ftruncate(fileno(local_log->segment_fp), (off_t)offset)) != 0) {
+            return rc;
+        }
+    }
+    local_log->segment_offset = offset;
+    return 0;
+}
 
-    opts.keepAliveInterval = 20;
-    opts.cleansession = 1;
-    opts.username = local_log->user;
-    opts.password = local_log->password;
+// Make sure the index of a sealed segment is complete.
+int local_log_check_segment(struct LocalLog *const local_log, size_t segment)
+{
+    int rc;
+    uint64_t first_seq = segment_first(local_log, segment);
+    char *name = segment_filename(local_log->filename, first_seq);
+    FILE *segment_fp = fopen(name, "rb");
+    free(name);
+    if (segment_fp == NULL) {
+        printf("failed to open segment %016" PRIx64 ": io error\n", first_seq);
+        return -1;
+    }
 
-    if ((rc = MQTTClient_connect(client, &opts)) != MQTTCLIENT_SUCCESS) {
-        printf("Failed to connect, return code %d\n", rc);
-        exit(EXIT_FAILURE);
+    FILE *index_fp;
+    uint64_t index_entries;
+    name = segment_filename(local_log->index_filename, first_seq);
+    rc = local_index_open(name, first_seq, segment_end(local_log, segment) - first_seq,
+                          segment_fp, &index_fp, &index_entries);
+    free(name);
+    fclose(segment_fp);
+    if (rc == 0) {
+        fclose(index_fp);
     }
+    return rc;
+}
 
-    printf("Connect to broker succeeded\n");
-    // encode json entries
-    size_t index = 0;
-    struct json_object *obj = NULL;
-
-    for (; index < local_log->header->entries &&
-         local_log_entries[index]->seq < local_log->header->next_publish; index++);
-    for (; index < local_log->header->entries; index++) {
-        obj = json_object_new_object();
-        rc = encode_log_entry_json(obj, local_log_entries[index]);
-        if (rc != 0) {
-            printf("failed to encode entry at #%zd\n", index);
-            for (size_t i = 0; i < local_log->header->entries; i++) {
-                log_entry_free(local_log_entries[i]);
-            }
-            free(local_log_entries);
-            json_object_put(obj);
-            return 1;
-        }
+// Seal the active segment and start a new one at the next sequence.
+int local_log_roll(struct LocalLog *const local_log)
+{
+    int rc;
+    uint64_t first_seq = local_log->header->sequence;
 
-        // publish message
-        msg.payload = (void *)json_object_to_json_string_length(
-                          obj, JSON_C_TO_STRING_SPACED, (size_t *)&msg.payloadlen);
-        msg.qos = 1;
-        msg.retained = 0;
-        MQTTClient_publishMessage(client, local_log->topic, &msg, &token);
-        rc = MQTTClient_waitForCompletion(client, token, 10000L);
+    fclose(local_log->segment_fp);
+    fclose(local_log->index_fp);
+    local_log->segment_fp = NULL;
+    local_log->index_fp = NULL;
 
-        if (rc != 0) {
-            printf("failed to publish message at #%zd\n", index);
-            for (size_t i = 0; i < local_log->header->entries; i++) {
-                log_entry_free(local_log_entries[i]);
-            }
-            free(local_log_entries);
-            json_object_put(obj);
-            return 1;
-        }
+    // Create the segment before the manifest refers to it
+    if ((rc = local_log_open_segment(local_log, first_seq, 0)) != 0) {
+        return rc;
+    }
 
-        json_object_put(obj);
+    // The header must cover the sealed segment before the manifest starts a new one
+    if ((rc = local_log_write_header(local_log)) != 0) {
+        return rc;
+    }
 
-        // Update header
-        struct Buffer *headbuff = malloc(sizeof(*headbuff));
-        buffer_init(headbuff);
-        local_log->header->next_publish++;
-        rc = fseek(local_log->fp, 0, SEEK_SET);
-        if (rc != 0) {
-            for (size_t i = 0; i < local_log->header->entries; i++) {
-                log_entry_free(local_log_entries[i]);
-            }
-            free(local_log_entries);
-            return rc;
+    struct LocalManifest *manifest = local_log->manifest;
+    manifest = realloc((void *)manifest, sizeof(*manifest) + (manifest->count + 1)*sizeof(uint64_t));
+    manifest->segments[manifest->count++] = first_seq;
+    local_log->manifest = manifest;
+    return local_manifest_write(local_log);
+}
+
+// Delete sealed segments whose entries are all published, committed by chain and durably applied
+// to the local database.
+int local_log_retire(struct LocalLog *const local_log)
+{
+    int rc;
+    uint64_t watermark = local_log->header->next_publish;
+    if (local_log->header->next_commit < watermark) {
+        watermark = local_log->header->next_commit;
+    }
+    if (local_log->durable_apply < watermark) {
+        watermark = local_log->durable_apply;
+    }
+
+    struct LocalManifest *manifest = local_log->manifest;
+    size_t retired = 0;
+    while (retired + 1 < manifest->count && manifest->segments[retired + 1] <= watermark) {
+        retired++;
+    }
+    if (retired == 0) {
+        return 0;
+    }
+
+    uint64_t *segments = malloc(retired*sizeof(uint64_t));
+    memcpy(segments, manifest->segments, retired*sizeof(uint64_t));
+    memmove(manifest->segments, manifest->segments + retired,
+            (manifest->count - retired)*sizeof(uint64_t));
+    manifest->count -= retired;
+    local_log->header->entries = (uint32_t)(local_log->header->sequence - manifest->segments[0]);
+
+    // Persist the watermarks that allowed this before the manifest drops the segments, and drop
+    // them from the manifest before deleting, so that a crash leaves unreferenced files at worst
+    if ((rc = local_log_write_header(local_log)) != 0
+        || (rc = local_manifest_write(local_log)) != 0) {
+        free(segments);
+        return rc;
+    }
+    for (size_t i = 0; i < retired; i++) {
+        printf("retire local log segment %016" PRIx64 "\n", segments[i]);
+        char *name = segment_filename(local_log->filename, segments[i]);
+        unlink(name);
+        free(name);
+        name = segment_filename(local_log->index_filename, segments[i]);
+        unlink(name);
+        free(name);
+    }
+    free(segments);
+    return 0;
+}
+
+// Write the pending group of entries, then their index records, then the header, pushing each
+// to the given durability level before the next one refers to it.
+int local_log_commit_group(struct LocalLog *const local_log, enum Durability durability)
+{
+    int rc;
+    if (local_log->pending_entries == 0) {
+        return 0;
+    }
+
+    // A failed attempt may have flushed part of the group, it is written again from the start
+    local_log->pending->read_p = 0;
+    local_log->pending_index->read_p = 0;
+    local_log->pending->fp = local_log->segment_fp;
+    if ((rc = fseek(local_log->segment_fp, (long)local_log->segment_offset, SEEK_SET)) != 0
+        || (rc = buffer_flush(local_log->pending)) != 0
+        || (rc = sync_file(local_log->segment_fp, durability)) != 0) {
+        return rc;
+    }
+
+    local_log->pending_index->fp = local_log->index_fp;
+    if ((rc = fseek(local_log->index_fp,
+                    LOCAL_INDEX_HEADER_SIZE + local_log->index_entries*LOCAL_INDEX_RECORD_SIZE,
+                    SEEK_SET)) != 0
+        || (rc = buffer_flush(local_log->pending_index)) != 0
+        || (rc = sync_file(local_log->index_fp, durability)) != 0) {
+        return rc;
+    }
+
+    local_log->segment_offset += local_log->pending->offset;
+    local_log->index_entries += local_log->pending_entries;
+    local_log->pending_entries = 0;
+    buffer_reset(local_log->pending);
+    buffer_reset(local_log->pending_index);
+
+    if ((rc = local_log_update_header(local_log)) != 0) {
+        return rc;
+    }
+    return sync_file(local_log->fp, durability);
+}
+
+int local_log_sync(struct LocalLog *const local_log)
+{
+    int rc = local_log_commit_group(local_log, local_log->durability);
+    if (rc == 0 && local_log->header_dirty) {
+        rc = local_log_write_header(local_log);
+    }
+    return rc;
+}
+
+// A cursor walks the local log from a given sequence, decoding one entry at a time from a
+// mapping of the segment it is in into an arena that is reset on every step. The entry returned
+// by local_log_cursor_next is owned by the cursor and stays valid until the next call.
+struct LogCursor {
+    struct LocalLog *local_log;
+    // next sequence to decode and the end of the log when the cursor was opened
+    uint64_t seq;
+    uint64_t end;
+    // segment currently mapped
+    size_t segment;
+    struct Buffer *buffer;
+    struct Arena arena;
+    // encoded bytes of the last entry, in the mapped segment
+    const void *raw;
+    size_t raw_size;
+};
+
+int local_log_cursor_open(struct LocalLog *const local_log, uint64_t seq, struct LogCursor **dest)
+{
+    int rc;
+    if (local_log->writer_running) {
+        printf("cannot read the local log while the writer is running\n");
+        return SQLITE_MISUSE;
+    }
+    if (seq < local_log->manifest->segments[0]) {
+        printf("entry %" PRIu64 " has been retired from local log\n", seq);
+        return -1;
+    }
+
+    // Entries are read through their own file handles, make the pending ones visible first
+    enum Durability durability = local_log->durability;
+    if (durability < DurabilityWrite) {
+        durability = DurabilityWrite;
+    }
+    if ((rc = local_log_commit_group(local_log, durability)) != 0
+        || (rc = fflush(local_log->segment_fp)) != 0
+        || (rc = fflush(local_log->index_fp)) != 0) {
+        return rc;
+    }
+
+    struct LogCursor *ddest = malloc(sizeof(*ddest));
+    ddest->local_log = local_log;
+    ddest->seq = seq;
+    ddest->end = local_log->header->sequence;
+    ddest->segment = 0;
+    ddest->buffer = NULL;
+    arena_init(&ddest->arena, LOCAL_LOG_ARENA_BLOCK_SIZE);
+    ddest->raw = NULL;
+    ddest->raw_size = 0;
+    *dest = ddest;
+    return 0;
+}
+
+// Map the segment holding the next sequence and position the cursor at its entry.
+int local_log_cursor_map(struct LogCursor *const cursor)
+{
+    int rc;
+    struct LocalLog *local_log = cursor->local_log;
+    size_t segment = segment_of(local_log, cursor->seq);
+    uint64_t first_seq = segment_first(local_log, segment);
+    uint64_t offset = 0;
+
+    if (cursor->buffer != NULL) {
+        buffer_free(cursor->buffer);
+        cursor->buffer = NULL;
+    }
+
+    // The index of the segment gives the offset of the sequence, unless it is the first one of the
+    // segment; later segments are reached by stepping past the end and start at offset 0
+    if (cursor->seq > first_seq) {
+        char *name = segment_filename(local_log->index_filename, first_seq);
+        FILE *index_fp = fopen(name, "rb");
+        free(name);
+        if (index_fp == NULL) {
+            return -1;
         }
-        encode_local_log_header(headbuff, local_log->header);
-        rc = buffer_flush(headbuff);
-        buffer_free(headbuff);
+        rc = local_index_lookup(index_fp, cursor->seq - first_seq, &offset);
+        fclose(index_fp);
         if (rc != 0) {
-            printf("failed to update file header for #%zd\n", index);
-            for (size_t i = 0; i < local_log->header->entries; i++) {
-                log_entry_free(local_log_entries[i]);
-            }
-            free(local_log_entries);
             return rc;
         }
     }
 
-    MQTTClient_disconnect(client, 10000);
-    MQTTClient_destroy(&client);
-
-    for (size_t i = 0; i < local_log->header->entries; i++) {
-        log_entry_free(local_log_entries[i]);
+    char *name = segment_filename(local_log->filename, first_seq);
+    FILE *segment_fp = fopen(name, "rb");
+    free(name);
+    if (segment_fp == NULL) {
+        return -1;
+    }
+    struct Buffer *buffer = malloc(sizeof(*buffer));
+    buffer_init(buffer);
+    rc = buffer_map(buffer, segment_fp);
+    fclose(segment_fp);
+    if (rc != 0 || offset > buffer->offset) {
+        buffer_free(buffer);
+        return -1;
     }
-    free(local_log_entries);
+    buffer->read_p = (size_t)offset;
 
+    cursor->segment = segment;
+    cursor->buffer = buffer;
     return 0;
 }
+
+// Decode the next entry into *entry, or set it to NULL at the end of the log.
+int local_log_cursor_next(struct LogCursor *const cursor, struct LogEntry **entry)
+{
+    int rc;
+    arena_reset(&cursor->arena);
+    if (cursor->seq >= cursor->end) {
+        *entry = NULL;
+        return 0;
+    }
+
+    if (cursor->buffer == NULL || cursor->seq >= segment_end(cursor->local_log, cursor->segment)) {
+        if ((rc = local_log_cursor_map(cursor)) != 0) {
+            printf("failed to map segment for entry %" PRIu64 "\n", cursor->seq);
+            return rc;
+        }
+    }
+
+    size_t start = cursor->buffer->read_p;
+    rc = decode_log_entry(cursor->buffer, &cursor->arena, entry);
+    if (rc != 0) {
+        printf("failed to decode entry at #%" PRIu64 "\n", cursor->seq);
+        return rc;
+    }
+    cursor->raw = (const uint8_t *)cursor->buffer->buffer + start;
+    cursor->raw_size = cursor->buffer->read_p - start;
+    cursor->seq++;
+    return 0;
+}
+
+void local_log_cursor_close(struct LogCursor *const cursor)
+{
+    arena_free(&cursor->arena);
+    if (cursor->buffer != NULL) {
+        buffer_free(cursor->buffer);
+    }
+    free(cursor);
+}
+
+// A binary payload carries a contiguous range of entries in the local log encoding:
+//   u32 magic, u8 version, u8 flags, u32 count, then count entries as encode_log_entry writes
+// them. The magic tells it from a JSON payload, which starts with "{"; readers reject versions
+// and flags they do not know.
+//
+// A compressed payload, binary or JSON, has the same header with the compressed flag, followed by
+//   u32 CRC-32 of the dictionary or 0 without one, u32 size before compression, compressed data
+// where the data is the entries of a binary payload, or the JSON text when the JSON flag is set.
+#define LOCAL_PAYLOAD_MAGIC       0x2e435142
+#define LOCAL_PAYLOAD_VERSION     0x01
+#define LOCAL_PAYLOAD_HEADER_SIZE 10
+#define LOCAL_PAYLOAD_COMPRESSED  0x01
+#define LOCAL_PAYLOAD_JSON        0x02
+#define LOCAL_PAYLOAD_COMPRESSED_HEADER_SIZE 18
+// payloads smaller than this are not worth compressing
+#define LOCAL_COMPRESS_MIN_SIZE   64
+// largest payload an MQTT message can carry, and so the largest a compressed one can stand for
+#define LOCAL_PAYLOAD_MAX_SIZE    268435455
+// distinct patterns local_log_build_dictionary keeps track of
+#define LOCAL_DICTIONARY_PATTERNS 256
+
+void encode_log_payload_header(struct Buffer *const dest, uint8_t flags, uint32_t count)
+{
+    encode_uint32(dest, LOCAL_PAYLOAD_MAGIC);
+    encode_uint8(dest, LOCAL_PAYLOAD_VERSION);
+    encode_uint8(dest, flags);
+    encode_uint32(dest, count);
+}
+
+struct PayloadReader {
+    struct Buffer buffer;
+    uint32_t remaining;
+    struct Arena arena;
+};
+
+// Open a binary payload for reading. The payload is decoded in place and must outlive the reader.
+int log_payload_reader_open(const void *payload, size_t size, struct PayloadReader **dest)
+{
+    int rc;
+    struct PayloadReader *ddest = malloc(sizeof(*ddest));
+    buffer_init(&ddest->buffer);
+    ddest->buffer.buffer = (void *)payload;
+    ddest->buffer.offset = size;
+    ddest->buffer.size = size;
+
+    uint32_t magic;
+    uint8_t version;
+    uint8_t flags;
+    if ((rc = decode_uint32(&ddest->buffer, &magic)) != 0
+        || (rc = decode_uint8(&ddest->buffer, &version)) != 0
+        || (rc = decode_uint8(&ddest->buffer, &flags)) != 0
+        || (rc = decode_uint32(&ddest->buffer, &ddest->remaining)) != 0) {
+        printf("payload too short\n");
+        free(ddest);
+        return rc;
+    }
+    if (magic != LOCAL_PAYLOAD_MAGIC) {
+        printf("not a binary payload\n");
+        free(ddest);
+        return 1;
+    }
+    if ((flags & LOCAL_PAYLOAD_COMPRESSED) != 0) {
+        printf("compressed payload, decompress it first\n");
+        free(ddest);
+        return 1;
+    }
+    if (version != LOCAL_PAYLOAD_VERSION || flags != 0) {
+        printf("unsupported payload version %u, flags 0x%02x\n", version, flags);
+        free(ddest);
+        return 1;
+    }
+    arena_init(&ddest->arena, LOCAL_LOG_ARENA_BLOCK_SIZE);
+    *dest = ddest;
+    return 0;
+}
+
+// Decode the next entry of a binary payload into *entry, or set it to NULL after the last one.
+// The entry is owned by the reader and valid until the following call.
+int log_payload_reader_next(struct PayloadReader *const reader, struct LogEntry **entry)
+{
+    int rc;
+    arena_reset(&reader->arena);
+    if (reader->remaining == 0) {
+        *entry = NULL;
+        return 0;
+    }
+    if ((rc = decode_log_entry(&reader->buffer, &reader->arena, entry)) != 0) {
+        printf("failed to decode payload entry\n");
+        return rc;
+    }
+    reader->remaining--;
+    return 0;
+}
+
+void log_payload_reader_close(struct PayloadReader *const reader)
+{
+    arena_free(&reader->arena);
+    free(reader);
+}
+
+// Whether a payload is compressed, returns 1 if it is and 0 otherwise.
+int log_payload_is_compressed(const void *payload, size_t size)
+{
+    const uint8_t *p = payload;
+    uint32_t magic;
+    if (size < LOCAL_PAYLOAD_COMPRESSED_HEADER_SIZE) {
+        return 0;
+    }
+    memcpy(&magic, p, sizeof(magic));
+    return be32toh(magic) == LOCAL_PAYLOAD_MAGIC && (p[5] & LOCAL_PAYLOAD_COMPRESSED) != 0;
+}
+
+// Decompress a payload with the dictionary it was compressed with, or NULL if it was compressed
+// without one. *dest is set to the payload as it would have been published uncompressed, binary
+// or JSON, in memory the caller frees.
+int log_payload_decompress(const void *payload, size_t size, const void *dictionary,
+                           size_t dictionary_size, void **dest, size_t *dest_size)
+{
+    int rc;
+    struct Buffer src;
+    buffer_init(&src);
+    src.buffer = (void *)payload;
+    src.offset = size;
+    src.size = size;
+
+    uint32_t magic, count, dictionary_id, original_size;
+    uint8_t version, flags;
+    if ((rc = decode_uint32(&src, &magic)) != 0
+        || (rc = decode_uint8(&src, &version)) != 0
+        || (rc = decode_uint8(&src, &flags)) != 0
+        || (rc = decode_uint32(&src, &count)) != 0
+        || (rc = decode_uint32(&src, &dictionary_id)) != 0
+        || (rc = decode_uint32(&src, &original_size)) != 0) {
+        printf("payload too short\n");
+        return rc;
+    }
+    if (magic != LOCAL_PAYLOAD_MAGIC || version != LOCAL_PAYLOAD_VERSION
+        || (flags & ~(LOCAL_PAYLOAD_COMPRESSED | LOCAL_PAYLOAD_JSON)) != 0
+        || (flags & LOCAL_PAYLOAD_COMPRESSED) == 0) {
+        printf("not a compressed payload\n");
+        return 1;
+    }
+    uint32_t expected_id = dictionary != NULL && dictionary_size > 0
+                           ? checksum_crc32(dictionary, dictionary_size) : 0;
+    if (dictionary_id != expected_id) {
+        printf("payload compressed with dictionary %08x, not %08x\n", dictionary_id, expected_id);
+        return 1;
+    }
+
+    // The size comes from the message, do not let it ask for more than the data can produce
+    if (original_size > LOCAL_PAYLOAD_MAX_SIZE
+        || original_size > lz_decompress_bound(size - src.read_p)) {
+        printf("payload claims %" PRIu32 " bytes uncompressed, more than it can hold\n", original_size);
+        return 1;
+    }
+
+    int json = (flags & LOCAL_PAYLOAD_JSON) != 0;
+    struct Buffer *ddest = malloc(sizeof(*ddest));
+    if (ddest == NULL) {
+        return -1;
+    }
+    buffer_init(ddest);
+    buffer_ensure(ddest, (json ? 0 : LOCAL_PAYLOAD_HEADER_SIZE) + (size_t)original_size);
+    if (ddest->buffer == NULL) {
+        printf("failed to allocate %" PRIu32 " bytes for payload\n", original_size);
+        free(ddest);
+        return -1;
+    }
+    if (!json) {
+        encode_log_payload_header(ddest, 0, count);
+    }
+    if (lz_decompress(dictionary, dictionary_size, (const uint8_t *)payload + src.read_p,
+                      size - src.read_p, (uint8_t *)ddest->buffer + ddest->offset, original_size) != 0) {
+        printf("corrupt compressed payload\n");
+        buffer_free(ddest);
+        return 1;
+    }
+    *dest_size = ddest->offset + original_size;
+    *dest = ddest->buffer;
+    free(ddest);
+    return 0;
+}
+
+// Text every published entry shares, whatever its statements
+#define LOCAL_DICTIONARY_KEYS \
+    "{ \"client_seq\": 0, \"entries\": [ { \"events\": [ { \"pattern\": \"\", \"args\": [ ] }, " \
+    "{ \"name\": null, \"type\": 0, \"value\": null }, { \"name\": null, \"type\": 3, \"value\": 0.0 }, " \
+    "{ \"name\": null, \"type\": 1, \"value\": \"\" }, { \"name\": null, \"type\": 2, \"value\": 0 } ] } ] }, " \
+    "{ \"client_id\": \""
+
+struct DictionaryPattern {
+    const char *pattern;
+    size_t size;
+    size_t uses;
+};
+
+int dictionary_pattern_compare(const void *a, const void *b)
+{
+    const struct DictionaryPattern *pa = a;
+    const struct DictionaryPattern *pb = b;
+    return pa->uses < pb->uses ? -1 : pa->uses > pb->uses;
+}
+
+// Gather a dictionary for local_log_set_publish_compression into up to capacity bytes of dest: the
+// JSON keys and client id every published entry has, then the SQL patterns of up to max_entries
+// of the latest entries in the local log. The most used patterns go last, closest to the data
+// and the cheapest to refer to, and the least used are left out when they do not all fit. With
+// max_entries 0, the dictionary only depends on the client id.
+int local_log_build_dictionary(struct LocalLog *const local_log, size_t max_entries,
+                               void *dest, size_t capacity, size_t *size)
+{
+    int rc;
+    struct Buffer *dictionary = malloc(sizeof(*dictionary));
+    buffer_init(dictionary);
+    encode_json_literal(dictionary, LOCAL_DICTIONARY_KEYS);
+    buffer_write(dictionary, local_log->client_id, strlen(local_log->client_id));
+    encode_json_literal(dictionary, "\", ");
+
+    // Count the uses of each pattern, in an arena since the cursor moves on
+    struct Arena arena;
+    arena_init(&arena, LOCAL_LOG_ARENA_BLOCK_SIZE);
+    struct DictionaryPattern patterns[LOCAL_DICTIONARY_PATTERNS];
+    size_t count = 0;
+    uint64_t start = local_log->header->sequence > max_entries
+                     ? local_log->header->sequence - max_entries : 0;
+    if (start < local_log->manifest->segments[0]) {
+        start = local_log->manifest->segments[0];
+    }
+    rc = 0;
+    if (max_entries > 0 && start < local_log->header->sequence) {
+        struct LogCursor *cursor;
+        struct LogEntry *entry;
+        if ((rc = local_log_cursor_open(local_log, start, &cursor)) != 0) {
+            arena_free(&arena);
+            buffer_free(dictionary);
+            return rc;
+        }
+        while ((rc = local_log_cursor_next(cursor, &entry)) == 0 && entry != NULL) {
+            for (size_t i = 0; i < entry->count; i++) {
+                const struct Event *event = entry->events[i];
+                size_t j = 0;
+                while (j < count && (patterns[j].size != event->pattern_size
+                                     || memcmp(patterns[j].pattern, event->pattern, event->pattern_size) != 0)) {
+                    j++;
+                }
+                if (j == count) {
+                    if (count == LOCAL_DICTIONARY_PATTERNS) {
+                        continue;
+                    }
+                    patterns[count].pattern = arena_strndup(&arena, event->pattern, event->pattern_size);
+                    patterns[count].size = event->pattern_size;
+                    patterns[count].uses = 0;
+                    count++;
+                }
+                patterns[j].uses++;
+            }
+        }
+        local_log_cursor_close(cursor);
+    }
+
+    if (rc == 0) {
+        qsort(patterns, count, sizeof(patterns[0]), dictionary_pattern_compare);
+        size_t total = dictionary->offset;
+        for (size_t i = 0; i < count; i++) {
+            total += patterns[i].size;
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (total > capacity) {
+                total -= patterns[i].size;
+                continue;
+            }
+            buffer_write(dictionary, patterns[i].pattern, patterns[i].size);
+        }
+        // The keys go first, the least used text of all, and are cut when they do not fit either
+        size_t skip = dictionary->offset > capacity ? dictionary->offset - capacity : 0;
+        memcpy(dest, (uint8_t *)dictionary->buffer + skip, dictionary->offset - skip);
+        *size = dictionary->offset - skip;
+    }
+    arena_free(&arena);
+    buffer_free(dictionary);
+    return rc;
+}
+
+struct LogJsonDecoder {
+    struct Arena arena;
+};
+
+int log_json_decoder_open(struct LogJsonDecoder **dest)
+{
+    struct LogJsonDecoder *ddest = malloc(sizeof(*ddest));
+    if (ddest == NULL) {
+        return -1;
+    }
+    arena_init(&ddest->arena, LOCAL_LOG_ARENA_BLOCK_SIZE);
+    *dest = ddest;
+    return 0;
+}
+
+// Decode an entry from JSON text in one pass. The entry is owned by the decoder and valid until
+// the following call; its strings may point into the payload, which must outlive it.
+int log_json_decoder_decode(struct LogJsonDecoder *const decoder, const void *payload, size_t size,
+                            struct LogEntry **entry)
+{
+    struct JsonReader reader;
+    arena_reset(&decoder->arena);
+    json_reader_init(&reader, payload, size);
+    return read_log_entry_json(&reader, &decoder->arena, entry);
+}
+
+void log_json_decoder_close(struct LogJsonDecoder *const decoder)
+{
+    arena_free(&decoder->arena);
+    free(decoder);
+}
+
+// Bind an argument without copying it, the statement must be done with it before the argument
+// goes away.
+int bind_argument(sqlite3_stmt *stmt, int index, const struct Argument *arg)
+{
+    switch (arg->type) {
+    case Null:
+        return sqlite3_bind_null(stmt, index);
+    case String:
+        return sqlite3_bind_text(stmt, index, (const char *)arg->value, (int)arg->size, SQLITE_STATIC);
+    case Int:
+        return sqlite3_bind_int64(stmt, index, *(sqlite3_int64 *)arg->value);
+    case Float:
+        return sqlite3_bind_double(stmt, index, *(double *)arg->value);
+    case Blob:
+        return sqlite3_bind_blob(stmt, index, arg->value, (int)arg->size, SQLITE_STATIC);
+    default:
+        return SQLITE_MISUSE;
+    }
+}
+
+// Bind the arguments of an event to the parameters of one of the statements of its pattern.
+// Unnamed arguments are consumed in order by the positional parameters, starting at *next_arg
+// which is advanced past them; named ones are looked up by the parameters that name them.
+int bind_event_arguments(sqlite3_stmt *stmt, const struct Event *event, size_t *next_arg)
+{
+    int rc = SQLITE_OK;
+    int params = sqlite3_bind_parameter_count(stmt);
+    for (int i = 1; i <= params && rc == SQLITE_OK; i++) {
+        const char *param = sqlite3_bind_parameter_name(stmt, i);
+        const struct Argument *arg = NULL;
+        if (param != NULL && param[0] != '?') {
+            // ":name", "@name" and "$name" match arguments by name with or without the prefix
+            size_t param_size = strlen(param);
+            for (size_t j = 0; j < event->count && arg == NULL; j++) {
+                const struct Argument *candidate = event->args[j];
+                if ((candidate->name_size == param_size
+                     && memcmp(candidate->name, param, param_size) == 0)
+                    || (candidate->name_size == param_size - 1
+                        && memcmp(candidate->name, param + 1, param_size - 1) == 0)) {
+                    arg = candidate;
+                }
+            }
+        } else {
+            // positional parameters take the unnamed arguments in order
+            while (*next_arg < event->count && event->args[*next_arg]->name_size > 0) {
+                (*next_arg)++;
+            }
+            if (*next_arg < event->count) {
+                arg = event->args[(*next_arg)++];
+            }
+        }
+        if (arg != NULL) {
+            rc = bind_argument(stmt, i, arg);
+        }
+    }
+    return rc;
+}
+
+// Hand a result row to a sqlite3_exec style callback.
+int exec_callback(sqlite3_stmt *stmt, int (*callback) (void *, int, char **, char **), void *arg)
+{
+    int columns = sqlite3_column_count(stmt);
+    char **names = malloc(2*(size_t)columns*sizeof(char *) + 1);
+    char **values = names + columns;
+    for (int i = 0; i < columns; i++) {
+        names[i] = (char *)sqlite3_column_name(stmt, i);
+        values[i] = (char *)sqlite3_column_text(stmt, i);
+    }
+    int rc = callback(arg, columns, values, names);
+    free(names);
+    return rc != 0 ? SQLITE_ABORT : SQLITE_OK;
+}
+
+// Run the statements of an event pattern with its arguments bound in place, through the
+// statement cache so that a pattern is only parsed and planned the first time it is seen. The
+// pattern does not need to be NUL-terminated. Unnamed arguments are consumed in order by the
+// positional parameters across the statements of the pattern.
+// Result rows go to callback, if any, like with sqlite3_exec. *writes, if given, is set when a
+// statement that may write to the database was run. On error *errmsg is set like sqlite3_exec
+// does and should be released with sqlite3_free.
+int apply_event(struct StmtCache *const cache, const struct Event *event,
+                int (*callback) (void *, int, char **, char **), void *callback_arg,
+                int *writes, char **errmsg)
+{
+    int rc = SQLITE_OK;
+    if (errmsg != NULL) {
+        *errmsg = NULL;
+    }
+    const char *sql = event->pattern;
+    const char *end = event->pattern + event->pattern_size;
+    size_t next_arg = 0;
+
+    while (rc == SQLITE_OK && sql < end) {
+        sqlite3_stmt *stmt = NULL;
+        const char *tail = NULL;
+        rc = stmt_cache_prepare(cache, sql, (size_t)(end - sql), &stmt, &tail);
+        if (rc != SQLITE_OK) {
+            break;
+        }
+        sql = tail;
+        if (stmt == NULL) {
+            // whitespace or comment
+            continue;
+        }
+
+        if (writes != NULL && !sqlite3_stmt_readonly(stmt)) {
+            *writes = 1;
+        }
+        rc = bind_event_arguments(stmt, event, &next_arg);
+        while (rc == SQLITE_OK && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            rc = callback != NULL ? exec_callback(stmt, callback, callback_arg) : SQLITE_OK;
+        }
+        if (rc == SQLITE_DONE) {
+            rc = SQLITE_OK;
+        }
+        if (rc != SQLITE_OK && errmsg != NULL) {
+            *errmsg = sqlite3_mprintf("%s", rc == SQLITE_ABORT ? sqlite3_errstr(rc) : sqlite3_errmsg(cache->db));
+        }
+        stmt_cache_release(cache, stmt);
+    }
+
+    if (rc != SQLITE_OK && errmsg != NULL && *errmsg == NULL) {
+        *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(cache->db));
+    }
+    return rc;
+}
+
+// Run SQL that takes no arguments and returns no rows through the statement cache.
+int local_log_exec_sql(struct LocalLog *const local_log, const char *sql, char **errmsg)
+{
+    struct Event event;
+    event_init(&event);
+    event.pattern = (char *)sql;
+    event.pattern_size = strlen(sql);
+    return apply_event(&local_log->stmt_cache, &event, NULL, NULL, NULL, errmsg);
+}
+
+// Apply the events of a log entry and advance the applied watermark past it, all within the
+// current transaction. Used for replay and for entries taken from upstream.
+int apply_log_entry(struct LocalLog *const local_log, const struct LogEntry *entry, char **errmsg)
+{
+    int rc = SQLITE_OK;
+    for (size_t i = 0; i < entry->count && rc == SQLITE_OK; i++) {
+        rc = apply_event(&local_log->stmt_cache, entry->events[i], NULL, NULL, NULL, errmsg);
+    }
+    if (rc == SQLITE_OK && (rc = mark_applied(local_log, entry->seq + 1)) != SQLITE_OK && errmsg != NULL) {
+        *errmsg = sqlite3_mprintf("cannot update applied watermark: %s", sqlite3_errmsg(local_log->db));
+    }
+    return rc;
+}
+
+// Report how often a statement was found in the statement cache and how often it was prepared.
+void local_log_stmt_cache_stats(const struct LocalLog *local_log, uint64_t *hits, uint64_t *misses)
+{
+    *hits = local_log->stmt_cache.hits;
+    *misses = local_log->stmt_cache.misses;
+}
+
+int cql_open(
+    const char *filename,
+    const char *client_id,
+    const char *address,
+    const char *user,
+    const char *password,
+    const char *topic,
+    struct LocalLog **dest)
+{
+    int rc;
+
+    struct LocalLog *ddest = malloc(sizeof(*ddest));
+    local_log_init(ddest);
+
+    ddest->filename = malloc(strlen(filename) + strlen("-loc") + 1);
+    strcpy(ddest->filename, filename);
+    strcat(ddest->filename, "-loc");
+
+    ddest->index_filename = malloc(strlen(filename) + strlen("-idx") + 1);
+    strcpy(ddest->index_filename, filename);
+    strcat(ddest->index_filename, "-idx");
+
+    ddest->manifest_filename = malloc(strlen(filename) + strlen("-manifest") + 1);
+    strcpy(ddest->manifest_filename, filename);
+    strcat(ddest->manifest_filename, "-manifest");
+
+    ddest->client_id = strdup(client_id);
+    ddest->address = strdup(address);
+    ddest->user = strdup(user);
+    ddest->password = strdup(password);
+    ddest->topic = strdup(topic);
+
+    // open db file
+    if ((rc = open_and_init_db(filename, &ddest->db)) != 0) {
+        local_log_free(ddest);
+        return rc;
+    }
+    ddest->stmt_cache.db = ddest->db;
+
+    uint64_t next_apply;
+    if ((rc = init_applied_watermark(ddest, &next_apply)) != 0) {
+        local_log_free(ddest);
+        return rc;
+    }
+    ddest->next_apply = next_apply;
+    ddest->durable_apply = next_apply;
+
+    struct Buffer *buffer = malloc(sizeof(*buffer));
+    buffer_init(buffer);
+
+    if (access(ddest->filename, F_OK) != 0) {
+        // File does not exist, initialize header
+        ddest->header = malloc(sizeof(*(ddest->header)));
+        ddest->header->magic = LOCAL_LOG_MAGIC;
+        ddest->header->version= LOCAL_LOG_VERSION;
+        ddest->header->generation = 0;
+        ddest->header->block_id= 0;
+        ddest->header->block_index = 0;
+        ddest->header->next_publish = 0;
+        ddest->header->sequence = 0;
+        ddest->header->next_commit = 0;
+        ddest->header->entries = 0;
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        ddest->header->salt = (uint32_t)now.tv_nsec ^ (uint32_t)now.tv_sec ^ (uint32_t)getpid();
+        ddest->header->checksum = 0;
+
+        ddest->manifest = malloc(sizeof(*(ddest->manifest)) + 1*sizeof(uint64_t));
+        ddest->manifest->magic = LOCAL_MANIFEST_MAGIC;
+        ddest->manifest->version = LOCAL_MANIFEST_VERSION;
+        ddest->manifest->count = 1;
+        ddest->manifest->segments[0] = 0;
+
+        // Create the first segment and the manifest, then make them valid by writing the header
+        if ((rc = local_log_open_segment(ddest, 0, 0)) != 0
+            || (rc = local_manifest_write(ddest)) != 0) {
+            buffer_free(buffer);
+            local_log_free(ddest);
+            return -1;
+        }
+
+        ddest->fp = fopen(ddest->filename, "w+b");
+        if (ddest->fp == NULL) {
+            buffer_free(buffer);
+            local_log_free(ddest);
+            return -1;
+        }
+
+        rc = local_log_write_header(ddest);
+        if (rc != 0) {
+            buffer_free(buffer);
+            local_log_free(ddest);
+            return -1;
+        }
+    } else {
+        ddest->fp = fopen(ddest->filename, "r+b");
+        if (ddest->fp == NULL) {
+            printf("failed to open file: io error\n");
+            buffer_free(buffer);
+            local_log_free(ddest);
+            return -1;
+        }
+
+        // Read header
+        rc = local_log_read_header(ddest);
+        if (rc != 0) {
+            printf("failed to decode header\n");
+            buffer_free(buffer);
+            local_log_free(ddest);
+            return -1;
+        }
+
+        printf("local log header: magic = %" PRIx32 " version = %" PRIx32 " generation = %" PRIu64
+               " seq = %" PRId64 " entries = %" PRId32"\n",
+               ddest->header->magic,
+               ddest->header->version,
+               ddest->header->generation,
+               ddest->header->sequence,
+               ddest->header->entries);
+
+        if (ddest->header->magic != LOCAL_LOG_MAGIC || ddest->header->version != LOCAL_LOG_VERSION) {
+            printf("unsupported local log version\n");
+            buffer_free(buffer);
+            local_log_free(ddest);
+            return -1;
+        }
+
+        // Read manifest
+        buffer_free(buffer);
+        buffer = malloc(sizeof(*buffer));
+        buffer_init(buffer);
+        buffer->fp = fopen(ddest->manifest_filename, "rb");
+        if (buffer->fp == NULL) {
+            printf("failed to open manifest: io error\n");
+            buffer_free(buffer);
+            local_log_free(ddest);
+            return -1;
+        }
+        rc = decode_local_manifest(buffer, &ddest->manifest);
+        fclose(buffer->fp);
+        buffer->fp = NULL;
+        if (rc != 0
+            || ddest->manifest->magic != LOCAL_MANIFEST_MAGIC
+            || ddest->manifest->version != LOCAL_MANIFEST_VERSION
+            || ddest->manifest->count == 0
+            || ddest->manifest->segments[ddest->manifest->count - 1] > ddest->header->sequence) {
+            printf("failed to decode manifest\n");
+            buffer_free(buffer);
+            local_log_free(ddest);
+            return -1;
+        }
+        ddest->header->entries = (uint32_t)(ddest->header->sequence - ddest->manifest->segments[0]);
+
+        // Check sealed segments and open the active one
+        size_t active = ddest->manifest->count - 1;
+        for (size_t i = 0; i < active; i++) {
+            if ((rc = local_log_check_segment(ddest, i)) != 0) {
+                buffer_free(buffer);
+                local_log_free(ddest);
+                return -1;
+            }
+        }
+        rc = local_log_open_segment(ddest, segment_first(ddest, active),
+                                    segment_end(ddest, active) - segment_first(ddest, active));
+        if (rc != 0) {
+            printf("failed to open local log segment\n");
+            buffer_free(buffer);
+            local_log_free(ddest);
+            return -1;
+        }
+        if (segment_first(ddest, active) + ddest->index_entries > ddest->header->sequence) {
+            printf("recovered %" PRIu64 " entries past the local log header\n",
+                   segment_first(ddest, active) + ddest->index_entries - ddest->header->sequence);
+            ddest->header->sequence = segment_first(ddest, active) + ddest->index_entries;
+            ddest->header->entries = (uint32_t)(ddest->header->sequence - ddest->manifest->segments[0]);
+            ddest->header_dirty = 1;
+        }
+        // Watermarks written before a retirement may lag behind the manifest
+        if (ddest->header->next_publish < ddest->manifest->segments[0]) {
+            ddest->header->next_publish = ddest->manifest->segments[0];
+        }
+        if (ddest->header->next_commit < ddest->manifest->segments[0]) {
+            ddest->header->next_commit = ddest->manifest->segments[0];
+        }
+
+        // Replay entries past the applied watermark
+        uint64_t from = next_apply;
+        if (from < ddest->manifest->segments[0]) {
+            printf("applied watermark %" PRIu64 " is behind the local log, replay from %" PRIu64 "\n",
+                   from, ddest->manifest->segments[0]);
+            from = ddest->manifest->segments[0];
+        }
+        struct LogCursor *cursor;
+        rc = local_log_cursor_open(ddest, from, &cursor);
+        if (rc != 0) {
+            buffer_free(buffer);
+            local_log_free(ddest);
+            return -1;
+        }
+        struct LogEntry *entry;
+        char *errmsg = NULL;
+        if ((rc = local_log_exec_sql(ddest, "BEGIN", &errmsg)) != SQLITE_OK) {
+            fprintf(stderr, "sql error: %s\n", errmsg);
+            sqlite3_free(errmsg);
+            local_log_cursor_close(cursor);
+            buffer_free(buffer);
+            local_log_free(ddest);
+            return 1;
+        }
+        while ((rc = local_log_cursor_next(cursor, &entry)) == 0 && entry != NULL) {
+            printf("replay log entry from local log: block_id = %" PRIu64 " block_index = %" PRIu64
+                   " seq = %" PRId64 "\n",
+                   entry->block_id,
+                   entry->block_index,
+                   entry->seq);
+            // TODO(leventeliu): verify entries.
+            if ((rc = apply_log_entry(ddest, entry, &errmsg)) != SQLITE_OK) {
+                fprintf(stderr, "sql error: %s\n", errmsg);
+                sqlite3_free(errmsg);
+                break;
+            }
+        }
+        local_log_cursor_close(cursor);
+        if (rc == 0 && (rc = local_log_exec_sql(ddest, "COMMIT", &errmsg)) != SQLITE_OK) {
+            fprintf(stderr, "sql error: %s\n", errmsg);
+            sqlite3_free(errmsg);
+        }
+        if (rc != 0) {
+            local_log_exec_sql(ddest, "ROLLBACK", NULL);
+            buffer_free(buffer);
+            local_log_free(ddest);
+            return 1;
+        }
+        ddest->durable_apply = ddest->next_apply;
+    }
+
+    buffer_free(buffer);
+    *dest = ddest;
+    return 0;
+}
+
+// Get ready to add an entry to the pending group, starting a new segment once the active one is
+// full.
+int local_log_prepare_append(struct LocalLog *const local_log)
+{
+    int rc;
+    if (local_log->segment_offset + local_log->pending->offset >= local_log->segment_size
+        && local_log->index_entries + local_log->pending_entries > 0) {
+        if ((rc = local_log_sync(local_log)) != 0 || (rc = local_log_roll(local_log)) != 0) {
+            printf("failed to start a new local log segment\n");
+            return rc;
+        }
+    }
+
+    if (local_log->pending_entries == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &local_log->pending_since);
+    }
+    encode_uint64(local_log->pending_index, local_log->segment_offset + local_log->pending->offset);
+    return 0;
+}
+
+// Account for an entry added to the pending group.
+void local_log_add_pending(struct LocalLog *const local_log)
+{
+    local_log->pending_entries++;
+    local_log->header->entries++;
+    local_log->header->sequence++;
+}
+
+// Account for an entry added to the pending group, and write the group once it is complete.
+int local_log_finish_append(struct LocalLog *const local_log)
+{
+    local_log_add_pending(local_log);
+
+    if (local_log->pending_entries < local_log->group_entries) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t elapsed_ms = (int64_t)(now.tv_sec - local_log->pending_since.tv_sec)*1000
+            + (now.tv_nsec - local_log->pending_since.tv_nsec)/1000000;
+        if (elapsed_ms < (int64_t)local_log->group_window_ms) {
+            return 0;
+        }
+    }
+    // The header follows its own interval, local_log_sync would write it after every group
+    return local_log_commit_group(local_log, local_log->durability);
+}
+
+// Take the last entry back out of the log after its group could not be written, whether it is
+// still pending or was written without the header taking it in. offset and index_entries are
+// where it starts in the active segment and its index.
+void local_log_drop_last(struct LocalLog *const local_log, uint64_t offset, uint64_t index_entries)
+{
+    if (local_log->index_entries > index_entries) {
+        local_log->pending_entries = 0;
+        buffer_reset(local_log->pending);
+        buffer_reset(local_log->pending_index);
+        local_log->segment_offset = offset;
+        local_log->index_entries = index_entries;
+        local_log->header_dirty = 1;
+    } else {
+        local_log->pending->offset = (size_t)(offset - local_log->segment_offset);
+        local_log->pending_index->offset -= sizeof(uint64_t);
+        local_log->pending_entries--;
+    }
+    local_log->header->sequence--;
+    local_log->header->entries--;
+}
+
+// Append an entry to the local log. When it cannot be written it is not in the log afterwards,
+// entries before it that are pending stay so.
+int local_log_append(struct LocalLog *const local_log, struct LogEntry *log_entry)
+{
+    int rc;
+    if ((rc = local_log_prepare_append(local_log)) != 0) {
+        return rc;
+    }
+    uint64_t offset = local_log->segment_offset + local_log->pending->offset;
+    uint64_t index_entries = local_log->index_entries + local_log->pending_entries;
+
+    // Append log entry and its index record to the pending group
+    log_entry->seq = local_log->header->sequence; // overwrite sequence number
+    encode_log_entry(local_log->pending, log_entry);
+    if ((rc = local_log_finish_append(local_log)) != 0) {
+        local_log_drop_last(local_log, offset, index_entries);
+    }
+    return rc;
+}
+
+// Merge upstream entries against the local log. Own entries seen upstream are checked against
+// the local log and advance the commit watermark; all upstream entries are moved to the merged
+// list. Local entries that are not yet on chain start at header->next_commit afterwards and are
+// read with a cursor by the caller, so they are never held in memory all at once.
+int local_log_merge(
+    struct LocalLog *const local_log,
+    struct LogEntry *upstream[], size_t upstream_size,
+    struct LogEntry ***merged, size_t *merged_size)
+{
+    int rc;
+    size_t ups_pos = 0;
+
+    if (local_log->writer_running) {
+        printf("cannot merge while the writer is running\n");
+        return SQLITE_MISUSE;
+    }
+
+    while (ups_pos < upstream_size && (
+               upstream[ups_pos]->block_id < local_log->header->block_id ||
+               (upstream[ups_pos]->block_id == local_log->header->block_id &&
+                upstream[ups_pos]->block_index <= local_log->header->block_index))) {
+        printf("upstream log entry is older than local: upstream = %" PRId64 ":%" PRId64
+               " local = %" PRId64 ":%" PRId64,
+               upstream[ups_pos]->block_id,
+               upstream[ups_pos]->block_index,
+               local_log->header->block_id,
+               local_log->header->block_index);
+        log_entry_free(upstream[ups_pos]);
+        ups_pos++;
+    }
+
+    // Local entries before the first one the miner has seen from us are discarded by the merge,
+    // and entries before the commit watermark are already known to be on chain, so only read the
+    // log from there.
+    uint64_t from = local_log->header->next_commit;
+    for (size_t i = ups_pos; i < upstream_size; i++) {
+        if (strcmp(local_log->client_id, upstream[i]->client_id) == 0) {
+            if (upstream[i]->seq > from) {
+                from = upstream[i]->seq;
+            }
+            break;
+        }
+    }
+    if (from < local_log->manifest->segments[0]) {
+        from = local_log->manifest->segments[0];
+    }
+    if (from > local_log->header->sequence) {
+        from = local_log->header->sequence;
+    }
+
+    struct LogCursor *cursor;
+    rc = local_log_cursor_open(local_log, from, &cursor);
+    if (rc != 0) {
+        return rc;
+    }
+    struct LogEntry *local_entry;
+    if ((rc = local_log_cursor_next(cursor, &local_entry)) != 0) {
+        local_log_cursor_close(cursor);
+        return rc;
+    }
+
+    // Start merge
+    struct LogEntry **dmerged = malloc(upstream_size*sizeof(void *));
+    size_t merged_pos = 0;
+    uint64_t next_commit = local_log->header->next_commit;
+
+    while (ups_pos < upstream_size) {
+        if (strcmp(local_log->client_id, upstream[ups_pos]->client_id) == 0 &&
+            upstream[ups_pos]->seq < from) {
+            // committed earlier, move from upstream to merged list directly
+            dmerged[merged_pos++] = upstream[ups_pos];
+        } else if (strcmp(local_log->client_id, upstream[ups_pos]->client_id) == 0) {
+            while (local_entry != NULL && local_entry->seq < upstream[ups_pos]->seq) {
+                printf("upstream log entry appears to be greater than local,"
+                       " maybe be skipped by miner: upstream = %s:%" PRId64
+                       " local = %s:%" PRId64,
+                       upstream[ups_pos]->client_id, upstream[ups_pos]->seq,
+                       local_log->client_id,
+                       local_entry->seq);
+                if ((rc = local_log_cursor_next(cursor, &local_entry)) != 0) {
+                    local_log_cursor_close(cursor);
+                    free(dmerged);
+                    return rc;
+                }
+            }
+            // match not found
+            if (local_entry == NULL) {
+                printf("upstream log entry matches local client_id,"
+                       " but cannot be found in local log, abort merging"
+                       " upstream = %s:%" PRId64 ", abort",
+                       upstream[ups_pos]->client_id, upstream[ups_pos]->seq);
+                local_log_cursor_close(cursor);
+                free(dmerged);
+                return 1;
+            }
+            if (local_entry->seq > upstream[ups_pos]->seq) {
+                printf("upstream log entry matches local client_id,"
+                       " but local sequence number is greater, abort merging"
+                       " upstream = %s:%" PRId64 ", abort",
+                       upstream[ups_pos]->client_id, upstream[ups_pos]->seq);
+                local_log_cursor_close(cursor);
+                free(dmerged);
+                return 1;
+            }
+            // matched, skip the duplicate local entry
+            next_commit = upstream[ups_pos]->seq + 1;
+            dmerged[merged_pos++] = upstream[ups_pos]; // move from upstream to merged list
+            if ((rc = local_log_cursor_next(cursor, &local_entry)) != 0) {
+                local_log_cursor_close(cursor);
+                free(dmerged);
+                return rc;
+            }
+        } else {
+            // unknown client source, move from upstream to merged list directly
+            dmerged[merged_pos++] = upstream[ups_pos];
+        }
+        ups_pos++;
+    }
+    local_log_cursor_close(cursor);
+    *merged = dmerged;
+    *merged_size = merged_pos;
+
+    // Advance the commit watermark and drop segments that are no longer needed
+    if (next_commit > local_log->header->next_commit) {
+        local_log->header->next_commit = next_commit;
+        if ((rc = local_log_write_header(local_log)) != 0 || (rc = local_log_retire(local_log)) != 0) {
+            printf("failed to update commit watermark\n");
+            return rc;
+        }
+    }
+    return 0;
+}
+
+// Open a transaction for statements run outside of cql_begin, unless one is open already.
+int local_log_begin_implicit(struct LocalLog *const local_log, char **errmsg)
+{
+    if (!sqlite3_get_autocommit(local_log->db)) {
+        return SQLITE_OK;
+    }
+    int rc = local_log_exec_sql(local_log, "BEGIN", errmsg);
+    if (rc == SQLITE_OK) {
+        local_log->uncommitted = 0;
+        clock_gettime(CLOCK_MONOTONIC, &local_log->uncommitted_since);
+    }
+    return rc;
+}
+
+// Roll the database back after the log could not be written, and drop the entries of the
+// transaction that did not make it to the log: those still pending and those written past
+// segment_offset and index_entries without the header taking them in.
+void local_log_abort_txn(struct LocalLog *const local_log, uint64_t segment_offset,
+                         uint64_t index_entries)
+{
+    uint64_t dropped = local_log->pending_entries;
+    if (local_log->index_entries > index_entries) {
+        dropped += local_log->index_entries - index_entries;
+        local_log->segment_offset = segment_offset;
+        local_log->index_entries = index_entries;
+        local_log->header_dirty = 1;
+    }
+    local_log->header->sequence -= dropped;
+    local_log->header->entries -= (uint32_t)dropped;
+    local_log->pending_entries = 0;
+    buffer_reset(local_log->pending);
+    buffer_reset(local_log->pending_index);
+
+    if (!sqlite3_get_autocommit(local_log->db)) {
+        local_log_exec_sql(local_log, "ROLLBACK", NULL);
+    }
+    local_log->in_transaction = 0;
+    local_log->uncommitted = 0;
+    local_log->next_apply = local_log->durable_apply;
+}
+
+// Write staged entries and pending groups to the local log, then commit the database. The log
+// goes first, so that every committed statement can be found there after a crash. The staged
+// entries are written as a single group, whatever the group commit settings. When the log
+// cannot be written the transaction is rolled back, nothing of it is committed later.
+int local_log_commit_txn(struct LocalLog *const local_log, char **errmsg)
+{
+    int rc = 0;
+    size_t position = 0;
+    uint64_t segment_offset = local_log->segment_offset;
+    uint64_t index_entries = local_log->index_entries;
+    for (size_t i = 0; i < local_log->staged_entries; i++) {
+        size_t size;
+        memcpy(&size, (uint8_t *)local_log->staged_sizes->buffer + i*sizeof(size), sizeof(size));
+        if (i == 0) {
+            // Only the first entry may start a new segment, the group is not split across two
+            if ((rc = local_log_prepare_append(local_log)) != 0) {
+                break;
+            }
+            segment_offset = local_log->segment_offset;
+            index_entries = local_log->index_entries;
+        } else {
+            encode_uint64(local_log->pending_index, local_log->segment_offset + local_log->pending->offset);
+        }
+        buffer_write(local_log->pending, (uint8_t *)local_log->staged->buffer + position, size);
+        position += size;
+        local_log_add_pending(local_log);
+    }
+    local_log->staged_entries = 0;
+    buffer_reset(local_log->staged);
+    buffer_reset(local_log->staged_sizes);
+    if (rc != 0 || (rc = local_log_commit_group(local_log, local_log->durability)) != 0) {
+        local_log_abort_txn(local_log, segment_offset, index_entries);
+        if (errmsg != NULL) {
+            *errmsg = sqlite3_mprintf("failed to append local log");
+        }
+        return rc;
+    }
+
+    if (!sqlite3_get_autocommit(local_log->db)
+        && (rc = local_log_exec_sql(local_log, "COMMIT", errmsg)) != SQLITE_OK) {
+        return rc;
+    }
+    local_log->in_transaction = 0;
+    local_log->uncommitted = 0;
+    local_log->durable_apply = local_log->next_apply;
+    return SQLITE_OK;
+}
+
+// Run the events of a new entry and record it in the local log as the next sequence. Inside of
+// cql_begin the entry is staged until the transaction commits. Entries that only read are not
+// recorded, there is nothing to replay or publish about them; *writes tells which it was.
+int local_log_run_entry(struct LocalLog *const local_log, struct LogEntry *entry,
+                        int (*callback) (void *, int, char **, char **), void *arg,
+                        int *writes, char **errmsg)
+{
+    int rc = SQLITE_OK;
+    entry->block_id = local_log->header->block_id;
+    entry->block_index = local_log->header->block_index;
+    entry->seq = local_log->header->sequence + local_log->staged_entries;
+
+    *writes = 0;
+    for (size_t i = 0; i < entry->count && rc == SQLITE_OK; i++) {
+        rc = apply_event(&local_log->stmt_cache, entry->events[i], callback, arg, writes, errmsg);
+    }
+    if (rc != SQLITE_OK || !*writes) {
+        return rc;
+    }
+
+    // Advance the watermark within the same transaction as the statements themselves
+    rc = mark_applied(local_log, entry->seq + 1);
+    if (rc != SQLITE_OK) {
+        if (errmsg != NULL) {
+            *errmsg = sqlite3_mprintf("failed to update applied watermark");
+        }
+        return rc;
+    }
+
+    if (local_log->in_transaction) {
+        size_t offset = local_log->staged->offset;
+        encode_log_entry(local_log->staged, entry);
+        size_t size = local_log->staged->offset - offset;
+        buffer_write(local_log->staged_sizes, &size, sizeof(size));
+        local_log->staged_entries++;
+        return SQLITE_OK;
+    }
+
+    rc = local_log_append(local_log, entry);
+    if (rc != 0 && errmsg != NULL) {
+        *errmsg = sqlite3_mprintf("failed to append local log");
+    }
+    return rc;
+}
+
+// Run an entry within a savepoint of the current transaction, so that a failure undoes what it
+// did without touching the statements run before it.
+int local_log_run_isolated(struct LocalLog *const local_log, struct LogEntry *entry,
+                           int (*callback) (void *, int, char **, char **), void *arg,
+                           int *writes, char **errmsg)
+{
+    int rc;
+    if ((rc = local_log_exec_sql(local_log, "SAVEPOINT cql_entry", errmsg)) != SQLITE_OK) {
+        return rc;
+    }
+    rc = local_log_run_entry(local_log, entry, callback, arg, writes, errmsg);
+    if (rc != SQLITE_OK) {
+        local_log_exec_sql(local_log, "ROLLBACK TO cql_entry", NULL);
+        local_log_exec_sql(local_log, "RELEASE cql_entry", NULL);
+        local_log->next_apply = entry->seq;
+        return rc;
+    }
+    return local_log_exec_sql(local_log, "RELEASE cql_entry", errmsg);
+}
+
+// Count a statement run outside of cql_begin and commit once the auto-commit policy says so.
+int local_log_auto_commit(struct LocalLog *const local_log, int writes, char **errmsg)
+{
+    if (local_log->in_transaction) {
+        return SQLITE_OK;
+    }
+    if (!writes) {
+        // Nothing to commit, but do not keep the snapshot of an otherwise empty transaction
+        if (local_log->uncommitted == 0 && !sqlite3_get_autocommit(local_log->db)) {
+            return local_log_exec_sql(local_log, "COMMIT", errmsg);
+        }
+        return SQLITE_OK;
+    }
+    local_log->uncommitted++;
+    if (local_log->uncommitted < local_log->commit_statements) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t elapsed_ms = (int64_t)(now.tv_sec - local_log->uncommitted_since.tv_sec)*1000
+            + (now.tv_nsec - local_log->uncommitted_since.tv_nsec)/1000000;
+        if (elapsed_ms < (int64_t)local_log->commit_window_ms) {
+            return SQLITE_OK;
+        }
+    }
+    return local_log_commit_txn(local_log, errmsg);
+}
+
+int local_log_exec_entry(struct LocalLog *const local_log, struct LogEntry *entry,
+                         int (*callback) (void *, int, char **, char **), void *arg, char **errmsg)
+{
+    int rc;
+    int writes;
+    if ((rc = local_log_begin_implicit(local_log, errmsg)) != SQLITE_OK) {
+        return rc;
+    }
+    // A pattern failing halfway leaves nothing behind for a later commit to pick up
+    rc = local_log_run_isolated(local_log, entry, callback, arg, &writes, errmsg);
+    if (rc != SQLITE_OK) {
+        // Do not keep the snapshot of an otherwise empty transaction
+        if (!local_log->in_transaction && local_log->uncommitted == 0
+            && !sqlite3_get_autocommit(local_log->db)) {
+            local_log_exec_sql(local_log, "ROLLBACK", NULL);
+            local_log->next_apply = local_log->durable_apply;
+        }
+        return rc;
+    }
+    return local_log_auto_commit(local_log, writes, errmsg);
+}
+
+// Start an explicit transaction. Statements run before it that are not committed yet are
+// committed first.
+int cql_begin(struct LocalLog *const local_log, char **errmsg)
+{
+    int rc;
+    if (local_log->writer_running) {
+        if (errmsg != NULL) {
+            *errmsg = sqlite3_mprintf("cannot start a transaction while the writer is running");
+        }
+        return SQLITE_MISUSE;
+    }
+    if (local_log->in_transaction) {
+        if (errmsg != NULL) {
+            *errmsg = sqlite3_mprintf("cannot start a transaction within a transaction");
+        }
+        return SQLITE_MISUSE;
+    }
+    if ((rc = local_log_commit_txn(local_log, errmsg)) != SQLITE_OK
+        || (rc = local_log_exec_sql(local_log, "BEGIN", errmsg)) != SQLITE_OK) {
+        return rc;
+    }
+    local_log->in_transaction = 1;
+    return SQLITE_OK;
+}
+
+// Commit the explicit transaction, or the statements run outside of one that are not committed
+// yet. With the writer running there is nothing to do, statements are committed before they
+// complete.
+int cql_commit(struct LocalLog *const local_log, char **errmsg)
+{
+    if (local_log->writer_running) {
+        return SQLITE_OK;
+    }
+    return local_log_commit_txn(local_log, errmsg);
+}
+
+// Roll back the explicit transaction, its entries never make it to the local log.
+int cql_rollback(struct LocalLog *const local_log, char **errmsg)
+{
+    if (!local_log->in_transaction) {
+        if (errmsg != NULL) {
+            *errmsg = sqlite3_mprintf("cannot rollback - no transaction is active");
+        }
+        return SQLITE_MISUSE;
+    }
+    local_log->in_transaction = 0;
+    local_log->staged_entries = 0;
+    buffer_reset(local_log->staged);
+    buffer_reset(local_log->staged_sizes);
+    local_log->next_apply = local_log->durable_apply;
+    return local_log_exec_sql(local_log, "ROLLBACK", errmsg);
+}
+
+// An entry queued for the writer thread. The thread that queued it waits for done, unless it
+// was queued by cql_exec_async: then the submission owns a copy of the entry, and is released by
+// the writer and the holder of its ticket, whichever is done with it last.
+struct Submission {
+    struct MpscNode node;
+    struct LogEntry *entry;
+    int (*callback) (void *, int, char **, char **);
+    void *arg;
+    int rc;
+    char *errmsg;
+    sem_t done;
+    // next in the batch of the writer
+    struct Submission *next;
+
+    int async;
+    void (*complete) (void *, int, const char *);
+    void *complete_arg;
+    // set once rc and errmsg are final
+    int completed;
+    int refs;
+    struct Arena arena;
+};
+
+void submission_release(struct Submission *submission)
+{
+    if (__atomic_sub_fetch(&submission->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    sem_destroy(&submission->done);
+    sqlite3_free(submission->errmsg);
+    arena_free(&submission->arena);
+    free(submission);
+}
+
+// Queue an entry for the writer thread and wait for it to be committed or to fail. Queueing
+// itself does not wait for the writer, whatever it is doing.
+int local_log_submit(struct LocalLog *const local_log, struct LogEntry *entry,
+                     int (*callback) (void *, int, char **, char **), void *arg, char **errmsg)
+{
+    struct Submission submission;
+    submission.entry = entry;
+    submission.callback = callback;
+    submission.arg = arg;
+    submission.rc = SQLITE_OK;
+    submission.errmsg = NULL;
+    sem_init(&submission.done, 0, 0);
+    submission.async = 0;
+    submission.complete = NULL;
+
+    mpsc_queue_push(&local_log->submissions, &submission.node);
+    sem_post(&local_log->submitted);
+    while (sem_wait(&submission.done) != 0) {
+    }
+    sem_destroy(&submission.done);
+
+    if (errmsg != NULL) {
+        *errmsg = submission.errmsg;
+    } else {
+        sqlite3_free(submission.errmsg);
+    }
+    return submission.rc;
+}
+
+// Run a batch of submissions in one transaction, each within a savepoint of its own so that one
+// failing does not fail the others, and commit them together.
+void local_log_writer_run(struct LocalLog *const local_log, struct Submission *batch)
+{
+    char *errmsg = NULL;
+    int rc = local_log_begin_implicit(local_log, &errmsg);
+    // Stage the entries like in an explicit transaction, to write them as one group on commit
+    local_log->in_transaction = 1;
+    for (struct Submission *submission = batch; submission != NULL; submission = submission->next) {
+        int writes;
+        if (rc != SQLITE_OK) {
+            submission->rc = rc;
+            submission->errmsg = sqlite3_mprintf("%s", errmsg);
+            continue;
+        }
+        submission->rc = local_log_run_isolated(local_log, submission->entry, submission->callback,
+                                                submission->arg, &writes, &submission->errmsg);
+    }
+    if (rc == SQLITE_OK && (rc = local_log_commit_txn(local_log, &errmsg)) != SQLITE_OK) {
+        if (!sqlite3_get_autocommit(local_log->db)) {
+            local_log_exec_sql(local_log, "ROLLBACK", NULL);
+        }
+        local_log->next_apply = local_log->durable_apply;
+        for (struct Submission *submission = batch; submission != NULL; submission = submission->next) {
+            if (submission->rc == SQLITE_OK) {
+                submission->rc = rc;
+                submission->errmsg = sqlite3_mprintf("%s", errmsg);
+            }
+        }
+    }
+    local_log->in_transaction = 0;
+    sqlite3_free(errmsg);
+
+    // Synchronous submissions live on the stacks of their threads, which go on once they are done
+    struct Submission *submission = batch;
+    while (submission != NULL) {
+        struct Submission *next = submission->next;
+        if (submission->complete != NULL) {
+            submission->complete(submission->complete_arg, submission->rc, submission->errmsg);
+        }
+        if (submission->async) {
+            __atomic_store_n(&submission->completed, 1, __ATOMIC_RELEASE);
+            sem_post(&submission->done);
+            submission_release(submission);
+        } else {
+            sem_post(&submission->done);
+        }
+        submission = next;
+    }
+}
+
+void *local_log_writer_main(void *arg)
+{
+    struct LocalLog *const local_log = arg;
+    for (;;) {
+        while (sem_wait(&local_log->submitted) != 0) {
+        }
+        // Everything queued by now goes into the next transactions, so a batch grows with the
+        // number of statements that came in while the previous one was committing
+        for (;;) {
+            struct Submission *batch = NULL;
+            struct Submission **last = &batch;
+            struct MpscNode *node;
+            size_t count = 0;
+            while (count < LOCAL_WRITER_BATCH_SIZE
+                   && (node = mpsc_queue_pop(&local_log->submissions)) != NULL) {
+                struct Submission *submission = (struct Submission *)node;
+                submission->next = NULL;
+                *last = submission;
+                last = &submission->next;
+                count++;
+            }
+            if (batch == NULL) {
+                break;
+            }
+            local_log_writer_run(local_log, batch);
+        }
+        if (__atomic_load_n(&local_log->writer_stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Start a thread that runs all statements from now on. cql_exec, cql_exec_args and
+// cql_exec_batch may then be called from any number of threads: their entries are queued for
+// the writer, which runs whatever has been queued in one transaction and commits it along with
+// the local log, then tells each caller how its entry went. Callbacks run on the writer thread.
+// Explicit transactions are not available in this mode, and queries need a read pool. The writer
+// owns the local log header and segments while it runs: cql_publish, local_log_merge and
+// local_log_cursor_open return SQLITE_MISUSE until local_log_stop_writer. Other calls on the
+// local log must not run at the same time as cql_exec.
+int local_log_start_writer(struct LocalLog *const local_log)
+{
+    int rc;
+    if (local_log->writer_running || local_log->in_transaction) {
+        return SQLITE_MISUSE;
+    }
+    if ((rc = local_log_commit_txn(local_log, NULL)) != SQLITE_OK) {
+        return rc;
+    }
+    mpsc_queue_init(&local_log->submissions);
+    sem_init(&local_log->submitted, 0, 0);
+    local_log->writer_stop = 0;
+    if (pthread_create(&local_log->writer, NULL, local_log_writer_main, local_log) != 0) {
+        sem_destroy(&local_log->submitted);
+        return -1;
+    }
+    local_log->writer_running = 1;
+    return 0;
+}
+
+// Stop the writer thread once it has run everything queued. No cql_exec may be in progress.
+void local_log_stop_writer(struct LocalLog *const local_log)
+{
+    if (!local_log->writer_running) {
+        return;
+    }
+    __atomic_store_n(&local_log->writer_stop, 1, __ATOMIC_RELEASE);
+    sem_post(&local_log->submitted);
+    pthread_join(local_log->writer, NULL);
+    sem_destroy(&local_log->submitted);
+    local_log->writer_running = 0;
+}
+
+// Copy an argument into an arena, so that it lives as long as the entry it belongs to.
+struct Argument *argument_copy(struct Arena *const arena, const struct Argument *src)
+{
+    struct Argument *dest = arena_alloc(arena, sizeof(*dest));
+    *dest = *src;
+    if (src->name_size > 0) {
+        dest->name = arena_strndup(arena, src->name, src->name_size);
+    }
+    if (src->type == Int) {
+        dest->value = arena_alloc(arena, sizeof(int64_t));
+        memcpy(dest->value, src->value, sizeof(int64_t));
+    } else if (src->type == Float) {
+        dest->value = arena_alloc(arena, sizeof(double));
+        memcpy(dest->value, src->value, sizeof(double));
+    } else if (src->type == String || src->type == Blob) {
+        dest->value = arena_alloc(arena, src->size > 0 ? src->size : 1);
+        memcpy(dest->value, src->value, src->size);
+    }
+    return dest;
+}
+
+// Queue a pattern and its arguments for the writer thread and return right away. Pattern and
+// arguments are copied. Once the statements are committed and the local log is as durable as
+// local_log_set_durability asks for, or once they failed, complete is called on the writer
+// thread with the result and error message, if any; it should be quick, the writer waits for
+// it. If ticket is not NULL it is set to a ticket to poll or wait for the result, which must be
+// released with cql_ticket_free. Entries of one thread are run in the order they were queued.
+int cql_exec_async(struct LocalLog *const local_log, const char *pattern,
+                   const struct Argument *args, size_t count,
+                   void (*complete) (void *, int, const char *), void *complete_arg,
+                   struct ExecTicket **ticket)
+{
+    if (!local_log->writer_running) {
+        return SQLITE_MISUSE;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if ((args[i].type == Int || args[i].type == Float) && args[i].value == NULL) {
+            return SQLITE_MISUSE;
+        }
+    }
+
+    struct Submission *submission = malloc(sizeof(*submission));
+    arena_init(&submission->arena, LOCAL_LOG_ARENA_BLOCK_SIZE);
+    struct Event *event = arena_alloc(&submission->arena, sizeof(*event) + count*sizeof(void *));
+    event_init(event);
+    event->pattern_size = strlen(pattern);
+    event->pattern = arena_strndup(&submission->arena, pattern, event->pattern_size);
+    event->count = count;
+    for (size_t i = 0; i < count; i++) {
+        event->args[i] = argument_copy(&submission->arena, &args[i]);
+    }
+    struct LogEntry *entry = arena_alloc(&submission->arena, sizeof(*entry) + 1*sizeof(void *));
+    log_entry_init(entry);
+    entry->client_id = local_log->client_id;
+    entry->client_id_size = strlen(local_log->client_id);
+    entry->count = 1;
+    entry->events[0] = event;
+
+    submission->entry = entry;
+    submission->callback = NULL;
+    submission->arg = NULL;
+    submission->rc = SQLITE_OK;
+    submission->errmsg = NULL;
+    sem_init(&submission->done, 0, 0);
+    submission->async = 1;
+    submission->complete = complete;
+    submission->complete_arg = complete_arg;
+    submission->completed = 0;
+    submission->refs = ticket != NULL ? 2 : 1;
+    if (ticket != NULL) {
+        *ticket = (struct ExecTicket *)submission;
+    }
+
+    mpsc_queue_push(&local_log->submissions, &submission->node);
+    sem_post(&local_log->submitted);
+    return SQLITE_OK;
+}
+
+// Tell whether the entry of a ticket is done, without waiting. Returns 0 while it is queued or
+// running, otherwise 1 with its result in *rc and its error message, owned by the ticket, in
+// *errmsg.
+int cql_ticket_poll(struct ExecTicket *ticket, int *rc, const char **errmsg)
+{
+    struct Submission *submission = (struct Submission *)ticket;
+    if (!__atomic_load_n(&submission->completed, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    if (rc != NULL) {
+        *rc = submission->rc;
+    }
+    if (errmsg != NULL) {
+        *errmsg = submission->errmsg;
+    }
+    return 1;
+}
+
+// Wait for the entry of a ticket to be done and return its result. Only one thread may wait on
+// a ticket.
+int cql_ticket_wait(struct ExecTicket *ticket, const char **errmsg)
+{
+    struct Submission *submission = (struct Submission *)ticket;
+    int rc;
+    if (!__atomic_load_n(&submission->completed, __ATOMIC_ACQUIRE)) {
+        while (sem_wait(&submission->done) != 0) {
+        }
+    }
+    cql_ticket_poll(ticket, &rc, errmsg);
+    return rc;
+}
+
+// Release a ticket. The entry is still run if it is not done yet.
+void cql_ticket_free(struct ExecTicket *ticket)
+{
+    if (ticket != NULL) {
+        submission_release((struct Submission *)ticket);
+    }
+}
+
+int cql_exec(struct LocalLog *const local_log, const char *sql,
+             int (*callback) (void *, int, char **, char **), void *arg, char **errmsg)
+{
+    return cql_exec_args(local_log, sql, NULL, 0, callback, arg, errmsg);
+}
+
+// Like cql_exec, but with the arguments of the pattern bound to it rather than rendered into it.
+// The pattern and arguments are recorded in the local log as they are.
+int cql_exec_args(struct LocalLog *const local_log, const char *pattern,
+                  const struct Argument *args, size_t count,
+                  int (*callback) (void *, int, char **, char **), void *arg, char **errmsg)
+{
+    int rc;
+    for (size_t i = 0; i < count; i++) {
+        if ((args[i].type == Int || args[i].type == Float) && args[i].value == NULL) {
+            if (errmsg != NULL) {
+                *errmsg = sqlite3_mprintf("argument %d has no value", (int)i);
+            }
+            return SQLITE_MISUSE;
+        }
+    }
+
+    // The entry only borrows the pattern, the arguments and the client id, it is encoded into
+    // the local log before returning.
+    struct Event *event = malloc(sizeof(*event) + count*sizeof(void *));
+    event_init(event);
+    event->pattern = (char *)pattern;
+    event->pattern_size = strlen(pattern);
+    event->count = count;
+    for (size_t i = 0; i < count; i++) {
+        event->args[i] = (struct Argument *)&args[i];
+    }
+    struct LogEntry *entry = malloc(sizeof(*entry) + 1*sizeof(void *));
+    log_entry_init(entry);
+    entry->client_id = local_log->client_id;
+    entry->client_id_size = strlen(local_log->client_id);
+    entry->count = 1;
+    entry->events[0] = event;
+
+    if (local_log->writer_running) {
+        rc = local_log_submit(local_log, entry, callback, arg, errmsg);
+    } else {
+        rc = local_log_exec_entry(local_log, entry, callback, arg, errmsg);
+    }
+
+    free(event);
+    free(entry);
+    return rc;
+}
+
+// Run a pattern once for each of rows rows of columns arguments each, laid out row after row in
+// args, all or nothing. The rows are recorded as a single entry with one event per row.
+int cql_exec_batch(struct LocalLog *const local_log, const char *pattern,
+                   const struct Argument *args, size_t columns, size_t rows, char **errmsg)
+{
+    int rc;
+    for (size_t i = 0; i < columns*rows; i++) {
+        if ((args[i].type == Int || args[i].type == Float) && args[i].value == NULL) {
+            if (errmsg != NULL) {
+                *errmsg = sqlite3_mprintf("argument %d of row %d has no value",
+                                          (int)(i % columns), (int)(i / columns));
+            }
+            return SQLITE_MISUSE;
+        }
+    }
+
+    // As with cql_exec_args the entry only borrows pattern and arguments, the events all share
+    // one arena.
+    struct Arena arena;
+    arena_init(&arena, LOCAL_LOG_ARENA_BLOCK_SIZE);
+    struct LogEntry *entry = arena_alloc(&arena, sizeof(*entry) + rows*sizeof(void *));
+    log_entry_init(entry);
+    entry->client_id = local_log->client_id;
+    entry->client_id_size = strlen(local_log->client_id);
+    entry->count = rows;
+    size_t pattern_size = strlen(pattern);
+    for (size_t i = 0; i < rows; i++) {
+        struct Event *event = arena_alloc(&arena, sizeof(*event) + columns*sizeof(void *));
+        event_init(event);
+        event->pattern = (char *)pattern;
+        event->pattern_size = pattern_size;
+        event->count = columns;
+        for (size_t j = 0; j < columns; j++) {
+            event->args[j] = (struct Argument *)&args[i*columns + j];
+        }
+        entry->events[i] = event;
+    }
+
+    if (local_log->writer_running) {
+        rc = local_log_submit(local_log, entry, NULL, NULL, errmsg);
+        arena_free(&arena);
+        return rc;
+    }
+    rc = local_log_exec_entry(local_log, entry, NULL, NULL, errmsg);
+    arena_free(&arena);
+    return rc;
+}
+
+// Open connections for cql_query to read from, so that queries can run on other threads than
+// the one writing and do not wait for it. Call it after cql_open and before starting to query.
+// Queries on the pool see what is committed; without a pool they run on the connection that
+// writes and also see statements that are not committed yet.
+int local_log_open_read_pool(struct LocalLog *const local_log, size_t connections)
+{
+    if (local_log->read_pool != NULL || connections == 0) {
+        return SQLITE_MISUSE;
+    }
+    struct ReadPool *pool = malloc(sizeof(*pool));
+    int rc = read_pool_open(pool, sqlite3_db_filename(local_log->db, "main"), connections,
+                            LOCAL_STMT_CACHE_SIZE);
+    if (rc != 0) {
+        free(pool);
+        return rc;
+    }
+    local_log->read_pool = pool;
+    return 0;
+}
+
+struct QueryCursor {
+    struct StmtCache *stmt_cache;
+    sqlite3_stmt *stmt;
+    // the pooled connection the query runs on, if any
+    struct ReadPool *read_pool;
+    struct ReadConnection *connection;
+};
+
+// Prepare and bind a query on the connection of a statement cache.
+int query_prepare(struct StmtCache *const cache, const char *pattern,
+                  const struct Argument *args, size_t count, sqlite3_stmt **dest, char **errmsg)
+{
+    int rc;
+    if (errmsg != NULL) {
+        *errmsg = NULL;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if ((args[i].type == Int || args[i].type == Float) && args[i].value == NULL) {
+            if (errmsg != NULL) {
+                *errmsg = sqlite3_mprintf("argument %d has no value", (int)i);
+            }
+            return SQLITE_MISUSE;
+        }
+    }
+
+    sqlite3_stmt *stmt = NULL;
+    const char *tail = NULL;
+    size_t pattern_size = strlen(pattern);
+    rc = stmt_cache_prepare(cache, pattern, pattern_size, &stmt, &tail);
+    if (rc != SQLITE_OK) {
+        if (errmsg != NULL) {
+            *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(cache->db));
+        }
+        return rc;
+    }
+    const char *message = NULL;
+    if (stmt == NULL) {
+        message = "query has no statement";
+    } else if (!sqlite3_stmt_readonly(stmt)) {
+        message = "query may only read, use cql_exec_args to write";
+    } else {
+        while (tail < pattern + pattern_size && (isspace((unsigned char)*tail) || *tail == ';')) {
+            tail++;
+        }
+        if (tail < pattern + pattern_size) {
+            message = "query takes a single statement";
+        }
+    }
+    if (message != NULL) {
+        if (stmt != NULL) {
+            stmt_cache_release(cache, stmt);
+        }
+        if (errmsg != NULL) {
+            *errmsg = sqlite3_mprintf("%s", message);
+        }
+        return SQLITE_MISUSE;
+    }
+
+    struct Event *event = malloc(sizeof(*event) + count*sizeof(void *));
+    event_init(event);
+    event->count = count;
+    for (size_t i = 0; i < count; i++) {
+        event->args[i] = (struct Argument *)&args[i];
+    }
+    size_t next_arg = 0;
+    rc = bind_event_arguments(stmt, event, &next_arg);
+    free(event);
+    if (rc != SQLITE_OK) {
+        if (errmsg != NULL) {
+            *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(cache->db));
+        }
+        stmt_cache_release(cache, stmt);
+        return rc;
+    }
+    *dest = stmt;
+    return SQLITE_OK;
+}
+
+// Run a single statement that only reads, with its arguments bound like with cql_exec_args, and
+// hand out its rows one at a time through cql_query_next. Queries are not recorded in the local
+// log; statements that write have to go through cql_exec_args to be logged and are refused.
+// With a read pool, queries may run on any thread, at the same time as statements that write.
+int cql_query(struct LocalLog *const local_log, const char *pattern,
+              const struct Argument *args, size_t count, struct QueryCursor **dest, char **errmsg)
+{
+    struct ReadConnection *connection = NULL;
+    struct StmtCache *cache = &local_log->stmt_cache;
+    if (local_log->read_pool == NULL && local_log->writer_running) {
+        if (errmsg != NULL) {
+            *errmsg = sqlite3_mprintf("queries need a read pool while the writer is running");
+        }
+        return SQLITE_MISUSE;
+    }
+    if (local_log->read_pool != NULL) {
+        connection = read_pool_acquire(local_log->read_pool);
+        cache = &connection->stmt_cache;
+    }
+    sqlite3_stmt *stmt;
+    int rc = query_prepare(cache, pattern, args, count, &stmt, errmsg);
+    if (rc != SQLITE_OK) {
+        if (connection != NULL) {
+            read_pool_release(local_log->read_pool, connection);
+        }
+        return rc;
+    }
+
+    struct QueryCursor *cursor = malloc(sizeof(*cursor));
+    cursor->stmt_cache = cache;
+    cursor->stmt = stmt;
+    cursor->read_pool = local_log->read_pool;
+    cursor->connection = connection;
+    *dest = cursor;
+    return SQLITE_OK;
+}
+
+// Step to the next row of a query. Returns SQLITE_ROW when there is one, SQLITE_DONE at the end
+// and an error code otherwise.
+int cql_query_next(struct QueryCursor *const cursor, char **errmsg)
+{
+    int rc = sqlite3_step(cursor->stmt);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE && errmsg != NULL) {
+        *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(cursor->stmt_cache->db));
+    }
+    return rc;
+}
+
+int cql_column_count(const struct QueryCursor *cursor)
+{
+    return sqlite3_column_count(cursor->stmt);
+}
+
+const char *cql_column_name(const struct QueryCursor *cursor, int column)
+{
+    return sqlite3_column_name(cursor->stmt, column);
+}
+
+enum Types cql_column_type(const struct QueryCursor *cursor, int column)
+{
+    switch (sqlite3_column_type(cursor->stmt, column)) {
+    case SQLITE_INTEGER:
+        return Int;
+    case SQLITE_FLOAT:
+        return Float;
+    case SQLITE_TEXT:
+        return String;
+    case SQLITE_BLOB:
+        return Blob;
+    default:
+        return Null;
+    }
+}
+
+int64_t cql_column_int64(const struct QueryCursor *cursor, int column)
+{
+    return sqlite3_column_int64(cursor->stmt, column);
+}
+
+double cql_column_double(const struct QueryCursor *cursor, int column)
+{
+    return sqlite3_column_double(cursor->stmt, column);
+}
+
+const char *cql_column_text(const struct QueryCursor *cursor, int column, size_t *size)
+{
+    const char *text = (const char *)sqlite3_column_text(cursor->stmt, column);
+    if (size != NULL) {
+        *size = (size_t)sqlite3_column_bytes(cursor->stmt, column);
+    }
+    return text;
+}
+
+const void *cql_column_blob(const struct QueryCursor *cursor, int column, size_t *size)
+{
+    const void *blob = sqlite3_column_blob(cursor->stmt, column);
+    if (size != NULL) {
+        *size = (size_t)sqlite3_column_bytes(cursor->stmt, column);
+    }
+    return blob;
+}
+
+// Release a query, which also ends the read transaction it holds while it has rows left.
+void cql_query_close(struct QueryCursor *const cursor)
+{
+    if (cursor == NULL) {
+        return;
+    }
+    stmt_cache_release(cursor->stmt_cache, cursor->stmt);
+    if (cursor->connection != NULL) {
+        read_pool_release(cursor->read_pool, cursor->connection);
+    }
+    free(cursor);
+}
+
+// Connect the MQTT client of the local log unless it is connected already, creating it the first
+// time. After a failed attempt no other is made until the backoff delay is over.
+//
+// The client is used synchronously and nothing drives it between calls, so no keepalive ping
+// goes out while the local log is idle. A session idle for longer than the keepalive may have
+// been dropped by the broker on a socket that still looks connected, it is replaced by a new one
+// rather than finding out when an acknowledgement times out. Within the keepalive the client is
+// given a chance to send a ping that is due.
+int local_log_mqtt_connect(struct LocalLog *const local_log)
+{
+    int rc;
+    if (!local_log->mqtt_created) {
+        rc = MQTTClient_create(&local_log->mqtt_client, local_log->address, local_log->client_id,
+                               MQTTCLIENT_PERSISTENCE_NONE, NULL);
+        if (rc != MQTTCLIENT_SUCCESS) {
+            printf("failed to create mqtt client, return code %d\n", rc);
+            return rc;
+        }
+        local_log->mqtt_created = 1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (MQTTClient_isConnected(local_log->mqtt_client)) {
+        int64_t idle_ms = (int64_t)(now.tv_sec - local_log->mqtt_active.tv_sec)*1000
+            + (now.tv_nsec - local_log->mqtt_active.tv_nsec)/1000000;
+        if (idle_ms < (int64_t)LOCAL_MQTT_KEEPALIVE_S*1000) {
+            MQTTClient_yield();
+            if (MQTTClient_isConnected(local_log->mqtt_client)) {
+                return MQTTCLIENT_SUCCESS;
+            }
+        } else {
+            MQTTClient_disconnect(local_log->mqtt_client, 0);
+        }
+    }
+
+    if (now.tv_sec < local_log->next_reconnect.tv_sec
+        || (now.tv_sec == local_log->next_reconnect.tv_sec
+            && now.tv_nsec < local_log->next_reconnect.tv_nsec)) {
+        return MQTTCLIENT_DISCONNECTED;
+    }
+
+    MQTTClient_connectOptions opts = MQTTClient_connectOptions_initializer;
+    opts.keepAliveInterval = LOCAL_MQTT_KEEPALIVE_S;
+    opts.cleansession = 1;
+    opts.username = local_log->user;
+    opts.password = local_log->password;
+    opts.maxInflightMessages = (int)local_log->publish_window;
+    if ((rc = MQTTClient_connect(local_log->mqtt_client, &opts)) != MQTTCLIENT_SUCCESS) {
+        if (local_log->reconnect_delay_ms == 0) {
+            local_log->reconnect_delay_ms = local_log->reconnect_min_ms;
+        } else if (local_log->reconnect_delay_ms < local_log->reconnect_max_ms / 2) {
+            local_log->reconnect_delay_ms *= 2;
+        } else {
+            local_log->reconnect_delay_ms = local_log->reconnect_max_ms;
+        }
+        local_log->next_reconnect.tv_sec = now.tv_sec + local_log->reconnect_delay_ms / 1000;
+        local_log->next_reconnect.tv_nsec = now.tv_nsec + (long)(local_log->reconnect_delay_ms % 1000)*1000000;
+        if (local_log->next_reconnect.tv_nsec >= 1000000000) {
+            local_log->next_reconnect.tv_sec++;
+            local_log->next_reconnect.tv_nsec -= 1000000000;
+        }
+        printf("failed to connect, return code %d, retry in %u ms\n", rc, local_log->reconnect_delay_ms);
+        return rc;
+    }
+    local_log->reconnect_delay_ms = 0;
+    local_log->mqtt_active = now;
+    printf("Connect to broker succeeded\n");
+    return MQTTCLIENT_SUCCESS;
+}
+
+// Builds the messages of cql_publish out of the entries of a cursor.
+struct Publisher {
+    struct LogCursor *cursor;
+    int end;
+    // entry read for a message it did not fit in, it starts the next one; it is the last entry
+    // read from the cursor, so it stays valid until the cursor moves on
+    struct LogEntry *carry;
+    // message being built, and compressed
+    struct Buffer payload;
+    struct Buffer compressed;
+};
+
+// Read the entry that starts or continues a message, or NULL at the end of the log.
+int local_log_publisher_next(struct Publisher *const publisher, struct LogEntry **entry)
+{
+    int rc;
+    *entry = NULL;
+    if (publisher->carry != NULL) {
+        *entry = publisher->carry;
+        publisher->carry = NULL;
+        return 0;
+    }
+    if (publisher->end) {
+        return 0;
+    }
+    if ((rc = local_log_cursor_next(publisher->cursor, entry)) != 0) {
+        return rc;
+    }
+    if (*entry == NULL) {
+        publisher->end = 1;
+    }
+    return 0;
+}
+
+// Pack up to envelope_entries encoded entries into a binary payload, copied as they are from
+// the local log.
+int local_log_publish_next_binary(struct LocalLog *const local_log, struct Publisher *const publisher,
+                                  size_t *count)
+{
+    int rc;
+    struct LogEntry *entry;
+    struct Buffer *payload = &publisher->payload;
+    encode_log_payload_header(payload, 0, 0);
+    while (*count < local_log->envelope_entries) {
+        if ((rc = local_log_publisher_next(publisher, &entry)) != 0) {
+            return rc;
+        }
+        if (entry == NULL) {
+            break;
+        }
+        const void *raw = publisher->cursor->raw;
+        size_t raw_size = publisher->cursor->raw_size;
+        if (*count > 0 && payload->offset + raw_size > local_log->envelope_bytes) {
+            publisher->carry = entry;
+            break;
+        }
+        buffer_write(payload, raw, raw_size);
+        (*count)++;
+    }
+    if (*count > 0) {
+        // Patch the entry count in the header
+        size_t offset = payload->offset;
+        payload->offset = LOCAL_PAYLOAD_HEADER_SIZE - sizeof(uint32_t);
+        encode_uint32(payload, (uint32_t)*count);
+        payload->offset = offset;
+    }
+    return 0;
+}
+
+// Write a single entry as JSON, or an envelope of entries when enabled.
+int local_log_publish_next_json(struct LocalLog *const local_log, struct Publisher *const publisher,
+                                size_t *count)
+{
+    int rc;
+    struct LogEntry *entry;
+    struct Buffer *payload = &publisher->payload;
+    if ((rc = local_log_publisher_next(publisher, &entry)) != 0 || entry == NULL) {
+        return rc;
+    }
+    if (local_log->envelope_entries <= 1) {
+        write_log_entry_json(payload, entry);
+        *count = 1;
+        return 0;
+    }
+
+    encode_json_literal(payload, "{ ");
+    encode_json_key(payload, "client_id");
+    encode_json_string(payload, local_log->client_id, strlen(local_log->client_id));
+    encode_json_literal(payload, ", ");
+    encode_json_key(payload, "client_seq");
+    encode_json_int64(payload, (int64_t)entry->seq);
+    encode_json_literal(payload, ", ");
+    encode_json_key(payload, "entries");
+    encode_json_literal(payload, "[ { ");
+    write_log_entry_events_json(payload, entry);
+    encode_json_literal(payload, " }");
+    *count = 1;
+    while (*count < local_log->envelope_entries) {
+        if ((rc = local_log_publisher_next(publisher, &entry)) != 0) {
+            return rc;
+        }
+        if (entry == NULL) {
+            break;
+        }
+        size_t offset = payload->offset;
+        encode_json_literal(payload, ", { ");
+        write_log_entry_events_json(payload, entry);
+        encode_json_literal(payload, " }");
+        // leave room for the closing brackets
+        if (payload->offset + 4 > local_log->envelope_bytes) {
+            payload->offset = offset;
+            publisher->carry = entry;
+            break;
+        }
+        (*count)++;
+    }
+    encode_json_literal(payload, " ] }");
+    return 0;
+}
+
+// Publish the compressed form of a payload instead when it is smaller.
+void local_log_compress_payload(struct LocalLog *const local_log, struct Publisher *const publisher,
+                                const void **payload, size_t *size, size_t count)
+{
+    const uint8_t *src = *payload;
+    size_t src_size = *size;
+    uint8_t flags = LOCAL_PAYLOAD_COMPRESSED;
+    if (local_log->publish_format == PayloadBinary) {
+        src += LOCAL_PAYLOAD_HEADER_SIZE;
+        src_size -= LOCAL_PAYLOAD_HEADER_SIZE;
+    } else {
+        flags |= LOCAL_PAYLOAD_JSON;
+    }
+    if (src_size < LOCAL_COMPRESS_MIN_SIZE) {
+        return;
+    }
+
+    struct Buffer *dest = &publisher->compressed;
+    buffer_reset(dest);
+    encode_log_payload_header(dest, flags, (uint32_t)count);
+    encode_uint32(dest, local_log->dictionary_id);
+    encode_uint32(dest, (uint32_t)src_size);
+    size_t bound = lz_compress_bound(src_size);
+    buffer_ensure(dest, bound);
+    size_t compressed_size = lz_compress(local_log->lz_dictionary, src, src_size,
+                                         (uint8_t *)dest->buffer + dest->offset, bound);
+    if (compressed_size == 0 || dest->offset + compressed_size >= *size) {
+        return;
+    }
+    dest->offset += compressed_size;
+    *payload = dest->buffer;
+    *size = dest->offset;
+}
+
+// Encode the next message to publish: a single entry, or an envelope of up to envelope_entries
+// entries and envelope_bytes bytes when enabled, in the publish format and compressed if that is
+// enabled and pays off. *count is set to the
+// number of entries in it, 0 at the end of the log. The payload is valid until the next call.
+int local_log_publish_next(struct LocalLog *const local_log, struct Publisher *const publisher,
+                           const void **payload, size_t *size, size_t *count)
+{
+    int rc;
+    *count = 0;
+    buffer_reset(&publisher->payload);
+    if (local_log->publish_format == PayloadBinary) {
+        rc = local_log_publish_next_binary(local_log, publisher, count);
+    } else {
+        rc = local_log_publish_next_json(local_log, publisher, count);
+    }
+    *payload = publisher->payload.buffer;
+    *size = publisher->payload.offset;
+    if (rc != 0 || *count == 0 || !local_log->compress) {
+        return rc;
+    }
+    local_log_compress_payload(local_log, publisher, payload, size, *count);
+    return 0;
+}
+
+// Publish an encoded message with QoS 1, without waiting for the broker to acknowledge it.
+int local_log_mqtt_publish(struct LocalLog *const local_log, const void *payload, size_t size,
+                           MQTTClient_deliveryToken *token)
+{
+    // The client keeps a copy of the payload until the message is acknowledged
+    MQTTClient_message msg = MQTTClient_message_initializer;
+    msg.payload = (void *)payload;
+    msg.payloadlen = (int)size;
+    msg.qos = 1;
+    msg.retained = 0;
+    int rc = MQTTClient_publishMessage(local_log->mqtt_client, local_log->topic, &msg, token);
+    if (rc != MQTTCLIENT_SUCCESS) {
+        return rc;
+    }
+
+    // PUBLISH packet: fixed header with the remaining length, topic, packet id and payload
+    size_t remaining = 2 + strlen(local_log->topic) + 2 + (size_t)msg.payloadlen;
+    local_log->published_bytes += 1 + (remaining < 128 ? 1 : remaining < 16384 ? 2 : remaining < 2097152 ? 3 : 4)
+        + remaining;
+    local_log->published_messages++;
+    return MQTTCLIENT_SUCCESS;
+}
+
+// Publish the entries of the local log that are not published yet, keeping up to the publish
+// window of messages in flight. Acknowledgements are waited for in order, so next_publish only
+// ever moves over entries that are acknowledged along with all entries before them; entries
+// still in flight when publishing fails are published again by a later call. The connection to
+// the broker is kept for the next call; when it cannot be made, nothing is published and the
+// error is returned. Stop the writer thread, if any, before publishing.
+int cql_publish(struct LocalLog *const local_log)
+{
+    int rc;
+    if (local_log->writer_running) {
+        printf("cannot publish while the writer is running\n");
+        return SQLITE_MISUSE;
+    }
+
+    // Walk entries not published yet
+    struct Publisher publisher = { 0 };
+    buffer_init(&publisher.payload);
+    buffer_init(&publisher.compressed);
+    rc = local_log_cursor_open(local_log, local_log->header->next_publish, &publisher.cursor);
+    if (rc != 0) {
+        return rc;
+    }
+
+    if ((rc = local_log_mqtt_connect(local_log)) != MQTTCLIENT_SUCCESS) {
+        local_log_cursor_close(publisher.cursor);
+        return rc;
+    }
+
+    // Tokens and entry counts of the messages in flight, oldest at first
+    size_t window = local_log->publish_window;
+    MQTTClient_deliveryToken *tokens = malloc(window*sizeof(*tokens));
+    size_t *counts = malloc(window*sizeof(*counts));
+    size_t first = 0;
+    size_t in_flight = 0;
+    int publish_rc = 0;
+
+    for (;;) {
+        while (publish_rc == 0 && in_flight < window) {
+            const void *payload;
+            size_t size;
+            size_t count;
+            if ((publish_rc = local_log_publish_next(local_log, &publisher, &payload, &size, &count)) != 0
+                || count == 0) {
+                break;
+            }
+            MQTTClient_deliveryToken *token = &tokens[(first + in_flight) % window];
+            publish_rc = local_log_mqtt_publish(local_log, payload, size, token);
+            if (publish_rc != MQTTCLIENT_SUCCESS && in_flight == 0
+                && !MQTTClient_isConnected(local_log->mqtt_client)) {
+                // The broker may have dropped an idle session, try once more on a new one
+                local_log->reconnect_delay_ms = 0;
+                local_log->next_reconnect.tv_sec = 0;
+                if (local_log_mqtt_connect(local_log) == MQTTCLIENT_SUCCESS) {
+                    publish_rc = local_log_mqtt_publish(local_log, payload, size, token);
+                }
+            }
+            if (publish_rc != 0) {
+                // The entries of the messages in flight come before those of this one
+                uint64_t seq = local_log->header->next_publish;
+                for (size_t i = 0; i < in_flight; i++) {
+                    seq += counts[(first + i) % window];
+                }
+                printf("failed to publish message at #%" PRIu64 "\n", seq);
+                break;
+            }
+            counts[(first + in_flight) % window] = count;
+            in_flight++;
+        }
+        if (in_flight == 0) {
+            break;
+        }
+
+        rc = MQTTClient_waitForCompletion(local_log->mqtt_client, tokens[first], 10000L);
+        if (rc != 0) {
+            printf("failed to publish message at #%" PRIu64 "\n", local_log->header->next_publish);
+            break;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &local_log->mqtt_active);
+
+        // Update header
+        local_log->header->next_publish += counts[first];
+        first = (first + 1) % window;
+        in_flight--;
+        rc = local_log_update_header(local_log);
+        if (rc != 0) {
+            printf("failed to update file header for #%" PRIu64 "\n", local_log->header->next_publish - 1);
+            break;
+        }
+    }
+    local_log_cursor_close(publisher.cursor);
+    free(publisher.payload.buffer);
+    free(publisher.compressed.buffer);
+    free(tokens);
+    free(counts);
+
+    if (rc == 0) {
+        rc = publish_rc;
+    }
+    if (rc != 0) {
+        return rc;
+    }
+    return local_log_retire(local_log);
+}
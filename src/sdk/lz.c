@@ -0,0 +1,229 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t lz_hash(uint32_t value)
+{
+    return (value * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// Hash every position of the dictionary that starts a full word. Positions are stored plus one,
+// so that 0 marks an empty slot.
+void lz_dictionary_init(struct LzDictionary *const dictionary, const void *data, size_t size)
+{
+    // Only the end of a dictionary can be reached from the input
+    if (size > LZ_WINDOW_SIZE) {
+        data = (const uint8_t *)data + (size - LZ_WINDOW_SIZE);
+        size = LZ_WINDOW_SIZE;
+    }
+    dictionary->data = data;
+    dictionary->size = size;
+    memset(dictionary->table, 0, sizeof(dictionary->table));
+    for (size_t i = 0; i + LZ_MIN_MATCH <= size; i++) {
+        dictionary->table[lz_hash(lz_read32(dictionary->data + i))] = (uint32_t)i + 1;
+    }
+}
+
+// Worst case size of count bytes compressed: all literals, with their length bytes.
+size_t lz_compress_bound(size_t count)
+{
+    return count + count/255 + 16;
+}
+
+// Most that count bytes of compressed data can decompress to. Every byte of a sequence, length
+// bytes included, stands for at most 255 bytes of output.
+size_t lz_decompress_bound(size_t count)
+{
+    return count*255;
+}
+
+static uint8_t *lz_write_length(uint8_t *p, size_t length)
+{
+    while (length >= 255) {
+        *p++ = 255;
+        length -= 255;
+    }
+    *p++ = (uint8_t)length;
+    return p;
+}
+
+static uint8_t *lz_write_sequence(uint8_t *p, const uint8_t *literals, size_t literal_count,
+                                  size_t offset, size_t match_length)
+{
+    uint8_t *token = p++;
+    *token = (uint8_t)((literal_count < 15 ? literal_count : 15) << 4);
+    if (literal_count >= 15) {
+        p = lz_write_length(p, literal_count - 15);
+    }
+    memcpy(p, literals, literal_count);
+    p += literal_count;
+    if (match_length == 0) {
+        return p;
+    }
+    *p++ = (uint8_t)(offset & 0xff);
+    *p++ = (uint8_t)(offset >> 8);
+    match_length -= LZ_MIN_MATCH;
+    *token |= (uint8_t)(match_length < 15 ? match_length : 15);
+    if (match_length >= 15) {
+        p = lz_write_length(p, match_length - 15);
+    }
+    return p;
+}
+
+// Length of the match between the input at i and the earlier position candidate, both counted
+// from the start of the dictionary. A match in the dictionary may run on into the input.
+static size_t lz_match_length(const struct LzDictionary *dictionary, const uint8_t *src,
+                              size_t count, size_t candidate, size_t i)
+{
+    size_t dictionary_size = dictionary != NULL ? dictionary->size : 0;
+    const uint8_t *p = src + (i - dictionary_size);
+    const uint8_t *end = src + count;
+    size_t n = 0;
+    if (candidate < dictionary_size) {
+        const uint8_t *q = dictionary->data + candidate;
+        size_t limit = dictionary_size - candidate;
+        if (limit > (size_t)(end - p)) {
+            limit = (size_t)(end - p);
+        }
+        while (n < limit && q[n] == p[n]) {
+            n++;
+        }
+        if (n < dictionary_size - candidate) {
+            return n;
+        }
+    }
+    const uint8_t *q = src + (candidate + n - dictionary_size);
+    const uint8_t *r = p + n;
+    while (r < end && *q == *r) {
+        q++;
+        r++;
+    }
+    return (size_t)(r - p);
+}
+
+// Compress count bytes of src into dest, which holds capacity bytes. Returns the compressed size,
+// or 0 if it does not fit.
+size_t lz_compress(const struct LzDictionary *dictionary, const void *src, size_t count,
+                   void *dest, size_t capacity)
+{
+    const uint8_t *in = src;
+    uint8_t *out = dest;
+    uint8_t *p = out;
+    size_t dictionary_size = dictionary != NULL ? dictionary->size : 0;
+    uint32_t table[1 << LZ_HASH_BITS];
+    if (dictionary != NULL) {
+        memcpy(table, dictionary->table, sizeof(table));
+    } else {
+        memset(table, 0, sizeof(table));
+    }
+    if (capacity < lz_compress_bound(count)) {
+        return 0;
+    }
+
+    // Positions are counted from the start of the dictionary
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + LZ_MIN_MATCH <= count) {
+        uint32_t h = lz_hash(lz_read32(in + i));
+        size_t position = dictionary_size + i;
+        size_t candidate = table[h];
+        table[h] = (uint32_t)position + 1;
+        size_t length = 0;
+        if (candidate > 0 && position - (candidate - 1) <= LZ_WINDOW_SIZE) {
+            length = lz_match_length(dictionary, in, count, candidate - 1, position);
+        }
+        if (length < LZ_MIN_MATCH) {
+            i++;
+            continue;
+        }
+        p = lz_write_sequence(p, in + anchor, i - anchor, position - (candidate - 1), length);
+        i += length;
+        anchor = i;
+    }
+    // The input always ends with a sequence of literals only
+    p = lz_write_sequence(p, in + anchor, count - anchor, 0, 0);
+    return (size_t)(p - out);
+}
+
+static int lz_read_length(const uint8_t **p, const uint8_t *end, size_t *length)
+{
+    uint8_t byte;
+    do {
+        if (*p >= end) {
+            return 1;
+        }
+        byte = *(*p)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+// Decompress count bytes of src into exactly size bytes of dest, with the dictionary src was
+// compressed with. Returns 0 on success and 1 on corrupt input.
+int lz_decompress(const void *dictionary, size_t dictionary_size, const void *src, size_t count,
+                  void *dest, size_t size)
+{
+    const uint8_t *in = src;
+    const uint8_t *end = in + count;
+    uint8_t *out = dest;
+    size_t produced = 0;
+    if (dictionary_size > LZ_WINDOW_SIZE) {
+        dictionary = (const uint8_t *)dictionary + (dictionary_size - LZ_WINDOW_SIZE);
+        dictionary_size = LZ_WINDOW_SIZE;
+    }
+
+    while (in < end) {
+        uint8_t token = *in++;
+        size_t literal_count = token >> 4;
+        if (literal_count == 15 && lz_read_length(&in, end, &literal_count) != 0) {
+            return 1;
+        }
+        if (literal_count > (size_t)(end - in) || literal_count > size - produced) {
+            return 1;
+        }
+        memcpy(out + produced, in, literal_count);
+        in += literal_count;
+        produced += literal_count;
+        if (in == end) {
+            break;
+        }
+
+        if (end - in < 2) {
+            return 1;
+        }
+        size_t offset = (size_t)in[0] | (size_t)in[1] << 8;
+        in += 2;
+        size_t length = token & 0xf;
+        if (length == 15 && lz_read_length(&in, end, &length) != 0) {
+            return 1;
+        }
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > produced + dictionary_size || length > size - produced) {
+            return 1;
+        }
+        // The part of the match that is in the dictionary, then the rest from the output
+        size_t j = 0;
+        if (offset > produced) {
+            const uint8_t *q = (const uint8_t *)dictionary + (dictionary_size - (offset - produced));
+            size_t n = offset - produced < length ? offset - produced : length;
+            memcpy(out + produced, q, n);
+            j = n;
+        }
+        // Byte by byte, the match may overlap what it produces
+        for (; j < length; j++) {
+            out[produced + j] = out[produced + j - offset];
+        }
+        produced += length;
+    }
+    return produced == size ? 0 : 1;
+}
@@ -0,0 +1,42 @@
+#ifndef COVENANTSQL_LZ_H
+#define COVENANTSQL_LZ_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/*
+** Make sure we can call this stuff from C++.
+*/
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Positions hashed by the match finder
+#define LZ_HASH_BITS 12
+// Farthest back a match can start, the dictionary included
+#define LZ_WINDOW_SIZE 65535
+
+// LZ77 compression in LZ4 style sequences: a token with the literal and match lengths, the
+// literals, then a 16 bit offset back to the match. Matches may reach into a dictionary that is
+// taken to precede the input, so that small messages can refer to text they all share.
+//
+// A dictionary is prepared once and used for any number of messages; it keeps a pointer to the
+// dictionary, which must outlive it.
+struct LzDictionary {
+    const uint8_t *data;
+    size_t size;
+    uint32_t table[1 << LZ_HASH_BITS];
+};
+
+void lz_dictionary_init(struct LzDictionary *const dictionary, const void *data, size_t size);
+size_t lz_compress_bound(size_t count);
+size_t lz_decompress_bound(size_t count);
+size_t lz_compress(const struct LzDictionary *dictionary, const void *src, size_t count,
+                   void *dest, size_t capacity);
+int lz_decompress(const void *dictionary, size_t dictionary_size, const void *src, size_t count,
+                  void *dest, size_t size);
+
+#ifdef __cplusplus
+}  /* End of the 'extern "C"' block */
+#endif
+#endif /* COVENANTSQL_LZ_H */
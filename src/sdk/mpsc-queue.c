@@ -0,0 +1,49 @@
+#include <stddef.h>
+
+#include "mpsc-queue.h"
+
+void mpsc_queue_init(struct MpscQueue *const queue)
+{
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+void mpsc_queue_push(struct MpscQueue *const queue, struct MpscNode *node)
+{
+    __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+    struct MpscNode *prev = __atomic_exchange_n(&queue->head, node, __ATOMIC_ACQ_REL);
+    // Until this store the node is not reachable from the tail
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+// Take the oldest item off the queue, or NULL if there is none. Only one thread may pop.
+struct MpscNode *mpsc_queue_pop(struct MpscQueue *const queue)
+{
+    struct MpscNode *tail = queue->tail;
+    struct MpscNode *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &queue->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        queue->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) {
+        // a push is halfway done
+        return NULL;
+    }
+    // tail is the last item, put the stub behind it so that it can be handed out
+    mpsc_queue_push(queue, &queue->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
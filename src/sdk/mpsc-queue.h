@@ -0,0 +1,34 @@
+#ifndef COVENANTSQL_MPSC_QUEUE_H
+#define COVENANTSQL_MPSC_QUEUE_H
+
+/*
+** Make sure we can call this stuff from C++.
+*/
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Link embedded in the items of a queue.
+struct MpscNode {
+    struct MpscNode *next;
+};
+
+// Intrusive, lock-free queue for many producers and a single consumer. Pushing is a single
+// atomic exchange and never waits for other producers or the consumer; pop may report an empty
+// queue while a push is halfway done, the item shows up once the push completes.
+struct MpscQueue {
+    // last pushed, swapped by producers
+    struct MpscNode *head;
+    // next to pop, only touched by the consumer
+    struct MpscNode *tail;
+    struct MpscNode stub;
+};
+
+void mpsc_queue_init(struct MpscQueue *const queue);
+void mpsc_queue_push(struct MpscQueue *const queue, struct MpscNode *node);
+struct MpscNode *mpsc_queue_pop(struct MpscQueue *const queue);
+
+#ifdef __cplusplus
+}  /* End of the 'extern "C"' block */
+#endif
+#endif /* COVENANTSQL_MPSC_QUEUE_H */
@@ -0,0 +1,76 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "read-pool.h"
+
+// Readers of a WAL database are not blocked by the writer, but may wait for a moment while it
+// runs a checkpoint or recovers the WAL index.
+#define READ_POOL_BUSY_TIMEOUT_MS 1000
+
+// Open size read-only connections to filename, which must be in WAL mode already.
+int read_pool_open(struct ReadPool *const pool, const char *filename, size_t size,
+                   size_t stmt_cache_size)
+{
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->available, NULL);
+    pool->connections = calloc(size, sizeof(*pool->connections));
+    pool->size = 0;
+    pool->free_list = NULL;
+
+    for (size_t i = 0; i < size; i++) {
+        struct ReadConnection *connection = &pool->connections[i];
+        // Each connection is only ever used by the thread that acquired it
+        int rc = sqlite3_open_v2(filename, &connection->db,
+                                 SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL);
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "cannot open read connection: %s\n", sqlite3_errmsg(connection->db));
+            sqlite3_close(connection->db);
+            read_pool_close(pool);
+            return 1;
+        }
+        sqlite3_busy_timeout(connection->db, READ_POOL_BUSY_TIMEOUT_MS);
+        stmt_cache_init(&connection->stmt_cache, connection->db, stmt_cache_size);
+        connection->next_free = pool->free_list;
+        pool->free_list = connection;
+        pool->size++;
+    }
+    return 0;
+}
+
+// Take a connection out of the pool, waiting for one to be released if all of them are in use.
+struct ReadConnection *read_pool_acquire(struct ReadPool *const pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->free_list == NULL) {
+        pthread_cond_wait(&pool->available, &pool->mutex);
+    }
+    struct ReadConnection *connection = pool->free_list;
+    pool->free_list = connection->next_free;
+    pthread_mutex_unlock(&pool->mutex);
+    return connection;
+}
+
+void read_pool_release(struct ReadPool *const pool, struct ReadConnection *connection)
+{
+    pthread_mutex_lock(&pool->mutex);
+    connection->next_free = pool->free_list;
+    pool->free_list = connection;
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Close the connections of the pool, none of them may be in use.
+void read_pool_close(struct ReadPool *const pool)
+{
+    for (size_t i = 0; i < pool->size; i++) {
+        stmt_cache_free(&pool->connections[i].stmt_cache);
+        sqlite3_close(pool->connections[i].db);
+    }
+    free(pool->connections);
+    pool->connections = NULL;
+    pool->size = 0;
+    pool->free_list = NULL;
+    pthread_cond_destroy(&pool->available);
+    pthread_mutex_destroy(&pool->mutex);
+}
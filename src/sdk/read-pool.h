@@ -0,0 +1,43 @@
+#ifndef COVENANTSQL_READ_POOL_H
+#define COVENANTSQL_READ_POOL_H
+
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stddef.h>
+
+#include "stmt-cache.h"
+
+/*
+** Make sure we can call this stuff from C++.
+*/
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A read-only connection to the database, used by one thread at a time.
+struct ReadConnection {
+    sqlite3 *db;
+    struct StmtCache stmt_cache;
+    struct ReadConnection *next_free;
+};
+
+// A fixed set of read-only connections to a WAL database, shared by threads that query it while
+// a single writer keeps writing through its own connection.
+struct ReadPool {
+    pthread_mutex_t mutex;
+    pthread_cond_t available;
+    struct ReadConnection *connections;
+    size_t size;
+    struct ReadConnection *free_list;
+};
+
+int read_pool_open(struct ReadPool *const pool, const char *filename, size_t size,
+                   size_t stmt_cache_size);
+struct ReadConnection *read_pool_acquire(struct ReadPool *const pool);
+void read_pool_release(struct ReadPool *const pool, struct ReadConnection *connection);
+void read_pool_close(struct ReadPool *const pool);
+
+#ifdef __cplusplus
+}  /* End of the 'extern "C"' block */
+#endif
+#endif /* COVENANTSQL_READ_POOL_H */
@@ -0,0 +1,190 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stmt-cache.h"
+
+struct StmtCacheEntry {
+    // chain of the hash bucket
+    struct StmtCacheEntry *next_hash;
+    // LRU list
+    struct StmtCacheEntry *prev;
+    struct StmtCacheEntry *next;
+    sqlite3_stmt *stmt;
+    // handed out and not released yet
+    int in_use;
+    uint64_t hash;
+    // length of the SQL text consumed by the statement, the rest of the key follows it
+    size_t tail;
+    size_t size;
+    char sql[];
+};
+
+static uint64_t stmt_cache_hash(const char *sql, size_t size)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (uint8_t)sql[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+void stmt_cache_init(struct StmtCache *const cache, sqlite3 *db, size_t capacity)
+{
+    cache->db = db;
+    cache->capacity = capacity > 0 ? capacity : 1;
+    cache->count = 0;
+    cache->bucket_count = 1;
+    while (cache->bucket_count < 2*cache->capacity) {
+        cache->bucket_count *= 2;
+    }
+    cache->buckets = calloc(cache->bucket_count, sizeof(*cache->buckets));
+    cache->head = NULL;
+    cache->tail = NULL;
+    cache->hits = 0;
+    cache->misses = 0;
+}
+
+static void stmt_cache_unlink(struct StmtCache *const cache, struct StmtCacheEntry *entry)
+{
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        cache->head = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        cache->tail = entry->prev;
+    }
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void stmt_cache_push_front(struct StmtCache *const cache, struct StmtCacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head != NULL) {
+        cache->head->prev = entry;
+    } else {
+        cache->tail = entry;
+    }
+    cache->head = entry;
+}
+
+// Drop the least recently used statement that is not in use. Returns 0 if all of them are.
+static int stmt_cache_evict(struct StmtCache *const cache)
+{
+    struct StmtCacheEntry *entry = cache->tail;
+    while (entry != NULL && entry->in_use) {
+        entry = entry->prev;
+    }
+    if (entry == NULL) {
+        return 0;
+    }
+    struct StmtCacheEntry **slot = &cache->buckets[entry->hash & (cache->bucket_count - 1)];
+    while (*slot != entry) {
+        slot = &(*slot)->next_hash;
+    }
+    *slot = entry->next_hash;
+    stmt_cache_unlink(cache, entry);
+    sqlite3_finalize(entry->stmt);
+    free(entry);
+    cache->count--;
+    return 1;
+}
+
+// Get a prepared statement for the first statement in sql, like sqlite3_prepare_v3 with a length
+// does, preparing it only when it is not cached yet. *stmt is set to NULL if sql holds nothing
+// but whitespace or comments. The statement is owned by the cache and must be handed back with
+// stmt_cache_release when done with it. A statement that is still in use, by a query that has
+// rows left for instance, is not handed out twice; a second one is prepared that is not cached.
+int stmt_cache_prepare(struct StmtCache *const cache, const char *sql, size_t size,
+                       sqlite3_stmt **stmt, const char **tail)
+{
+    uint64_t hash = stmt_cache_hash(sql, size);
+    struct StmtCacheEntry **bucket = &cache->buckets[hash & (cache->bucket_count - 1)];
+    int busy = 0;
+    for (struct StmtCacheEntry *entry = *bucket; entry != NULL; entry = entry->next_hash) {
+        if (entry->hash == hash && entry->size == size && memcmp(entry->sql, sql, size) == 0) {
+            if (entry->in_use) {
+                busy = 1;
+                break;
+            }
+            cache->hits++;
+            entry->in_use = 1;
+            stmt_cache_unlink(cache, entry);
+            stmt_cache_push_front(cache, entry);
+            *stmt = entry->stmt;
+            *tail = sql + entry->tail;
+            return SQLITE_OK;
+        }
+    }
+
+    cache->misses++;
+    sqlite3_stmt *dstmt = NULL;
+    const char *dtail = NULL;
+    int rc = sqlite3_prepare_v3(cache->db, sql, (int)size, SQLITE_PREPARE_PERSISTENT, &dstmt, &dtail);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    *stmt = dstmt;
+    *tail = dtail;
+    if (dstmt == NULL) {
+        return SQLITE_OK;
+    }
+
+    // A copy of a statement in use, or one that finds no room, is finalized on release
+    if (busy || (cache->count >= cache->capacity && !stmt_cache_evict(cache))) {
+        return SQLITE_OK;
+    }
+    struct StmtCacheEntry *entry = malloc(sizeof(*entry) + size);
+    entry->stmt = dstmt;
+    entry->in_use = 1;
+    entry->hash = hash;
+    entry->tail = (size_t)(dtail - sql);
+    entry->size = size;
+    memcpy(entry->sql, sql, size);
+    entry->next_hash = *bucket;
+    *bucket = entry;
+    stmt_cache_push_front(cache, entry);
+    cache->count++;
+    return SQLITE_OK;
+}
+
+// Reset a statement from stmt_cache_prepare for its next use, or finalize it if it was not
+// cached. This also ends the read transaction a statement holds while it has rows left.
+void stmt_cache_release(struct StmtCache *const cache, sqlite3_stmt *stmt)
+{
+    // Statements are released soon after they are prepared, so they are found near the head
+    for (struct StmtCacheEntry *entry = cache->head; entry != NULL; entry = entry->next) {
+        if (entry->stmt == stmt) {
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+            entry->in_use = 0;
+            return;
+        }
+    }
+    sqlite3_finalize(stmt);
+}
+
+void stmt_cache_free(struct StmtCache *const cache)
+{
+    struct StmtCacheEntry *entry = cache->head;
+    while (entry != NULL) {
+        struct StmtCacheEntry *next = entry->next;
+        sqlite3_finalize(entry->stmt);
+        free(entry);
+        entry = next;
+    }
+    free(cache->buckets);
+    cache->buckets = NULL;
+    cache->head = NULL;
+    cache->tail = NULL;
+    cache->count = 0;
+}
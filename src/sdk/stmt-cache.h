@@ -0,0 +1,41 @@
+#ifndef COVENANTSQL_STMT_CACHE_H
+#define COVENANTSQL_STMT_CACHE_H
+
+#include <inttypes.h>
+#include <sqlite3.h>
+
+/*
+** Make sure we can call this stuff from C++.
+*/
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct StmtCacheEntry;
+
+// LRU cache of prepared statements keyed by their SQL text, so that patterns that are run over
+// and over are parsed and planned once.
+struct StmtCache {
+    sqlite3 *db;
+    size_t capacity;
+    size_t count;
+    // hash buckets, a power of two at least twice the capacity
+    struct StmtCacheEntry **buckets;
+    size_t bucket_count;
+    // most recently used first
+    struct StmtCacheEntry *head;
+    struct StmtCacheEntry *tail;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+void stmt_cache_init(struct StmtCache *const cache, sqlite3 *db, size_t capacity);
+int stmt_cache_prepare(struct StmtCache *const cache, const char *sql, size_t size,
+                       sqlite3_stmt **stmt, const char **tail);
+void stmt_cache_release(struct StmtCache *const cache, sqlite3_stmt *stmt);
+void stmt_cache_free(struct StmtCache *const cache);
+
+#ifdef __cplusplus
+}  /* End of the 'extern "C"' block */
+#endif
+#endif /* COVENANTSQL_STMT_CACHE_H */
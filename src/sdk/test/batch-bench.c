@@ -0,0 +1,94 @@
+#include "config.h"
+#include "local-fixture.h"
+#include "../covenant-iot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROWS 10000
+#define BATCH 500
+
+static int open_bench(const char *filename, struct LocalLog **ll)
+{
+    char *errmsg = NULL;
+    remove_local_log(filename);
+    int rc = cql_open(filename, CLIENTID, ADDRESS, USER, PASSWORD, TOPIC, ll);
+    if (rc != 0) {
+        return rc;
+    }
+    local_log_set_segment_size(*ll, 1 << 30);
+    rc = cql_exec(*ll, "CREATE TABLE readings (sensor INTEGER, value REAL, unit TEXT)",
+                  NULL, NULL, &errmsg);
+    if (rc != 0) {
+        fprintf(stderr, "sql error: %s\n", errmsg);
+        sqlite3_free(errmsg);
+        local_log_free(*ll);
+    }
+    return rc;
+}
+
+int main()
+{
+    const char *filename = "./batch-bench";
+    struct LocalLog *ll;
+    char *errmsg = NULL;
+    int rc;
+
+    static int64_t sensors[ROWS];
+    static double values[ROWS];
+    static struct Argument args[ROWS*3];
+    for (size_t i = 0; i < ROWS; i++) {
+        sensors[i] = (int64_t)(i % 64);
+        values[i] = (double)i/10;
+        args[i*3] = (struct Argument){ NULL, 0, &sensors[i], 0, Int };
+        args[i*3 + 1] = (struct Argument){ NULL, 0, &values[i], 0, Float };
+        args[i*3 + 2] = (struct Argument){ NULL, 0, "celsius", strlen("celsius"), String };
+    }
+    const char *pattern = "INSERT INTO readings (sensor, value, unit) VALUES (?, ?, ?)";
+
+    // One row per cql_exec_args call
+    if ((rc = open_bench(filename, &ll)) != 0) {
+        return rc;
+    }
+    double start = now_seconds();
+    for (size_t i = 0; i < ROWS && rc == 0; i++) {
+        rc = cql_exec_args(ll, pattern, &args[i*3], 3, NULL, NULL, &errmsg);
+    }
+    if (rc == 0) {
+        rc = local_log_sync(ll);
+    }
+    double elapsed = now_seconds() - start;
+    local_log_free(ll);
+    remove_local_log(filename);
+    if (rc != 0) {
+        fprintf(stderr, "sql error: %s\n", errmsg);
+        sqlite3_free(errmsg);
+        return rc;
+    }
+    printf("per row:        %10.0f rows/sec\n", ROWS/elapsed);
+
+    // BATCH rows per cql_exec_batch call
+    if ((rc = open_bench(filename, &ll)) != 0) {
+        return rc;
+    }
+    start = now_seconds();
+    for (size_t i = 0; i < ROWS && rc == 0; i += BATCH) {
+        rc = cql_exec_batch(ll, pattern, &args[i*3], 3, BATCH, &errmsg);
+    }
+    if (rc == 0) {
+        rc = local_log_sync(ll);
+    }
+    elapsed = now_seconds() - start;
+    local_log_free(ll);
+    remove_local_log(filename);
+    if (rc != 0) {
+        fprintf(stderr, "sql error: %s\n", errmsg);
+        sqlite3_free(errmsg);
+        return rc;
+    }
+    printf("batch of %4d:  %10.0f rows/sec\n", BATCH, ROWS/elapsed);
+    return 0;
+}
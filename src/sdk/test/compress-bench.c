@@ -0,0 +1,176 @@
+#include "config.h"
+#include "local-fixture.h"
+#include "../buffer.h"
+#include "../covenant-iot.h"
+#include "../lz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ENTRIES 2000
+#define ROUNDS 20
+#define DICTIONARY_SIZE 16384
+
+// Entries like those of entries.json: a few statements over the same tables, with small
+// integer and text arguments.
+static int fill(struct LocalLog *ll)
+{
+    char *errmsg = NULL;
+    int rc = cql_exec(ll, "CREATE TABLE IF NOT EXISTS t1 (c1 int primary key, c2 text)",
+                      NULL, NULL, &errmsg);
+    if (rc == 0) {
+        rc = cql_exec(ll, "CREATE TABLE IF NOT EXISTS t2 (c1 int, c2 real, c3 text)",
+                      NULL, NULL, &errmsg);
+    }
+    for (size_t i = 0; i < ENTRIES - 2 && rc == 0; i++) {
+        int64_t k1 = (int64_t)i*2, k2 = (int64_t)i*2 + 1;
+        double value = (double)(i % 1000)/8;
+        char text1[32], text2[32];
+        snprintf(text1, sizeof(text1), "text%zu", i*2);
+        snprintf(text2, sizeof(text2), "text%zu", i*2 + 1);
+        struct Argument args[4] = {
+            { "", 0, &k1, 0, Int },
+            { "", 0, text1, strlen(text1), String },
+            { "", 0, &k2, 0, Int },
+            { "", 0, text2, strlen(text2), String },
+        };
+        switch (i % 4) {
+        case 0:
+        case 1:
+            rc = cql_exec_args(ll, "INSERT INTO t1 (c1, c2) VALUES (?, ?), (?, ?)", args, 4,
+                               NULL, NULL, &errmsg);
+            break;
+        case 2:
+            args[1] = (struct Argument){ "", 0, &value, 0, Float };
+            rc = cql_exec_args(ll, "INSERT INTO t2 (c1, c2, c3) VALUES (?, ?, ?)", args, 3,
+                               NULL, NULL, &errmsg);
+            break;
+        default:
+            rc = cql_exec_args(ll, "UPDATE t1 SET c2 = ? WHERE c1 = ?", &args[1], 2,
+                               NULL, NULL, &errmsg);
+            break;
+        }
+    }
+    if (rc != 0) {
+        fprintf(stderr, "sql error: %s\n", errmsg);
+        sqlite3_free(errmsg);
+    }
+    return rc;
+}
+
+// Compress the entries of the local log as JSON messages of envelope entries written one after
+// the other, and decompress them again, reporting the compression ratio and the CPU time per KB
+// of input.
+static int run(struct LocalLog *ll, size_t envelope, const char *name,
+               const void *dictionary, size_t dictionary_size)
+{
+    struct LzDictionary *lz_dictionary = NULL;
+    if (dictionary != NULL) {
+        lz_dictionary = malloc(sizeof(*lz_dictionary));
+        lz_dictionary_init(lz_dictionary, dictionary, dictionary_size);
+    }
+    struct Buffer *message = malloc(sizeof(*message));
+    struct Buffer *compressed = malloc(sizeof(*compressed));
+    struct Buffer *decompressed = malloc(sizeof(*decompressed));
+    buffer_init(message);
+    buffer_init(compressed);
+    buffer_init(decompressed);
+    double compress_time = 0, decompress_time = 0;
+    size_t in = 0, out = 0;
+    int rc = 0;
+
+    for (int round = 0; round < ROUNDS && rc == 0; round++) {
+        struct LogCursor *cursor;
+        struct LogEntry *entry;
+        if ((rc = local_log_cursor_open(ll, 0, &cursor)) != 0) {
+            break;
+        }
+        int end = 0;
+        while (!end && rc == 0) {
+            buffer_reset(message);
+            for (size_t i = 0; i < envelope; i++) {
+                if ((rc = local_log_cursor_next(cursor, &entry)) != 0 || entry == NULL) {
+                    end = 1;
+                    break;
+                }
+                write_log_entry_json(message, entry);
+            }
+            if (message->offset == 0) {
+                break;
+            }
+
+            size_t bound = lz_compress_bound(message->offset);
+            buffer_reset(compressed);
+            buffer_ensure(compressed, bound);
+            buffer_reset(decompressed);
+            buffer_ensure(decompressed, message->offset);
+            double start = cpu_seconds();
+            size_t size = lz_compress(lz_dictionary, message->buffer, message->offset,
+                                      compressed->buffer, bound);
+            double middle = cpu_seconds();
+            rc = lz_decompress(dictionary, dictionary_size, compressed->buffer, size,
+                               decompressed->buffer, message->offset);
+            double stop = cpu_seconds();
+            compress_time += middle - start;
+            decompress_time += stop - middle;
+            if (rc != 0 || memcmp(decompressed->buffer, message->buffer, message->offset) != 0) {
+                fprintf(stderr, "round trip failed\n");
+                rc = 1;
+            }
+            in += message->offset;
+            out += size;
+        }
+        local_log_cursor_close(cursor);
+    }
+    if (rc == 0) {
+        printf("envelope %3zu, dictionary %-8s %6.2fx, %5zu bytes/message, "
+               "compress %6.2f us/KB, decompress %6.2f us/KB\n",
+               envelope, name, (double)in/out, out/(ENTRIES*ROUNDS/envelope),
+               compress_time*1e6/(in/1024.0), decompress_time*1e6/(in/1024.0));
+    }
+    free(lz_dictionary);
+    buffer_free(message);
+    buffer_free(compressed);
+    buffer_free(decompressed);
+    return rc;
+}
+
+int main()
+{
+    const char *filename = "./compress-bench";
+    struct LocalLog *ll;
+    int rc;
+
+    remove_local_log(filename);
+    if ((rc = cql_open(filename, CLIENTID, ADDRESS, USER, PASSWORD, TOPIC, &ll)) != 0) {
+        return rc;
+    }
+    local_log_set_segment_size(ll, 1 << 30);
+    if ((rc = fill(ll)) != 0) {
+        local_log_free(ll);
+        return rc;
+    }
+
+    // The static dictionary only has the JSON keys and client id, the trained one the patterns
+    // of the entries too
+    static char keys[DICTIONARY_SIZE], trained[DICTIONARY_SIZE];
+    size_t keys_size, trained_size;
+    rc = local_log_build_dictionary(ll, 0, keys, sizeof(keys), &keys_size);
+    if (rc == 0) {
+        rc = local_log_build_dictionary(ll, ENTRIES, trained, sizeof(trained), &trained_size);
+    }
+    size_t envelopes[] = { 1, 16, 64 };
+    for (size_t i = 0; i < sizeof(envelopes)/sizeof(envelopes[0]) && rc == 0; i++) {
+        if ((rc = run(ll, envelopes[i], "none", NULL, 0)) != 0
+            || (rc = run(ll, envelopes[i], "static", keys, keys_size)) != 0
+            || (rc = run(ll, envelopes[i], "trained", trained, trained_size)) != 0) {
+            break;
+        }
+    }
+    local_log_free(ll);
+    remove_local_log(filename);
+    return rc;
+}
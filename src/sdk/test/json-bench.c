@@ -0,0 +1,204 @@
+#include "config.h"
+#include "local-fixture.h"
+#include "../buffer.h"
+#include "../covenant-iot.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ENTRIES 2000
+#define ROUNDS 20
+
+// Encode every entry of the local log ROUNDS times with json-c and with the streaming writer,
+// checking that both give the same text.
+static int bench_encode(struct LocalLog *ll)
+{
+    struct LogCursor *cursor;
+    struct LogEntry *entry;
+    struct Buffer *buffer = malloc(sizeof(*buffer));
+    buffer_init(buffer);
+    double json_c = 0, writer = 0;
+    size_t bytes = 0, entries = 0;
+    int rc = 0;
+
+    for (int round = 0; round < ROUNDS && rc == 0; round++) {
+        if ((rc = local_log_cursor_open(ll, 0, &cursor)) != 0) {
+            break;
+        }
+        while ((rc = local_log_cursor_next(cursor, &entry)) == 0 && entry != NULL) {
+            double start = now_seconds();
+            struct json_object *obj = json_object_new_object();
+            encode_log_entry_json(obj, entry);
+            size_t size;
+            const char *text = json_object_to_json_string_length(obj, JSON_C_TO_STRING_SPACED, &size);
+            double middle = now_seconds();
+            buffer_reset(buffer);
+            write_log_entry_json(buffer, entry);
+            double end = now_seconds();
+            json_c += middle - start;
+            writer += end - middle;
+
+            if (size != buffer->offset || memcmp(text, buffer->buffer, size) != 0) {
+                fprintf(stderr, "output differs at #%zu:\n%s\n%.*s\n", entries % ENTRIES, text,
+                        (int)buffer->offset, (char *)buffer->buffer);
+                rc = 1;
+            }
+            json_object_put(obj);
+            bytes += size;
+            entries++;
+        }
+        local_log_cursor_close(cursor);
+    }
+    buffer_free(buffer);
+    if (rc != 0) {
+        return rc;
+    }
+    printf("encode json-c:      %10.1f entries/sec %8.1f MB/s\n", entries/json_c, bytes/json_c/1e6);
+    printf("encode writer:      %10.1f entries/sec %8.1f MB/s\n", entries/writer, bytes/writer/1e6);
+    return 0;
+}
+
+// Decode the entries of the local log, written as blocks the way they come from upstream,
+// ROUNDS times with json-c and with the single pass decoder, checking that both give the same
+// entries. decode_log_entry_json logs every field it parses, stdout goes to /dev/null meanwhile.
+static int bench_decode(struct LocalLog *ll)
+{
+    struct LogCursor *cursor;
+    struct LogEntry *entry;
+    struct Buffer *texts = malloc(sizeof(*texts));
+    struct Buffer *expected = malloc(sizeof(*expected));
+    struct Buffer *actual = malloc(sizeof(*actual));
+    buffer_init(texts);
+    buffer_init(expected);
+    buffer_init(actual);
+    size_t offsets[ENTRIES + 1];
+    size_t count = 0;
+    int rc;
+
+    if ((rc = local_log_cursor_open(ll, 0, &cursor)) != 0) {
+        return rc;
+    }
+    while (count < ENTRIES && (rc = local_log_cursor_next(cursor, &entry)) == 0 && entry != NULL) {
+        char head[64];
+        offsets[count] = texts->offset;
+        buffer_write(texts, head, (size_t)snprintf(head, sizeof(head),
+                     "{ \"block_id\": %zu, \"block_index\": %zu, ", count / 100, count));
+        buffer_reset(actual);
+        write_log_entry_json(actual, entry);
+        buffer_write(texts, (char *)actual->buffer + 2, actual->offset - 2);
+        count++;
+    }
+    offsets[count] = texts->offset;
+    local_log_cursor_close(cursor);
+
+    struct LogJsonDecoder *decoder;
+    log_json_decoder_open(&decoder);
+    double json_c = 0, single_pass = 0;
+    int out = dup(STDOUT_FILENO);
+    for (int round = 0; round < ROUNDS && rc == 0; round++) {
+        for (size_t i = 0; i < count && rc == 0; i++) {
+            const char *text = (const char *)texts->buffer + offsets[i];
+            size_t size = offsets[i + 1] - offsets[i];
+
+            fflush(stdout);
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, STDOUT_FILENO);
+            close(null);
+            double start = now_seconds();
+            struct json_tokener *tok = json_tokener_new();
+            struct json_object *obj = json_tokener_parse_ex(tok, text, (int)size);
+            json_tokener_free(tok);
+            struct LogEntry *slow = NULL;
+            if (obj == NULL || decode_log_entry_json(obj, &slow) != 0) {
+                rc = 1;
+            }
+            json_object_put(obj);
+            json_c += now_seconds() - start;
+            fflush(stdout);
+            dup2(out, STDOUT_FILENO);
+
+            start = now_seconds();
+            if (rc == 0) {
+                rc = log_json_decoder_decode(decoder, text, size, &entry);
+            }
+            single_pass += now_seconds() - start;
+
+            if (rc == 0) {
+                buffer_reset(expected);
+                buffer_reset(actual);
+                write_log_entry_json(expected, slow);
+                write_log_entry_json(actual, entry);
+                if (expected->offset != actual->offset
+                    || memcmp(expected->buffer, actual->buffer, actual->offset) != 0) {
+                    fprintf(stderr, "decoded entries differ at #%zu\n", i);
+                    rc = 1;
+                }
+            } else {
+                fprintf(stderr, "failed to decode #%zu\n", i);
+            }
+            if (slow != NULL) {
+                log_entry_free(slow);
+            }
+        }
+    }
+    close(out);
+    log_json_decoder_close(decoder);
+    size_t bytes = texts->offset;
+    buffer_free(texts);
+    buffer_free(expected);
+    buffer_free(actual);
+    if (rc != 0) {
+        return rc;
+    }
+    printf("decode json-c:      %10.1f entries/sec %8.1f MB/s\n",
+           count*ROUNDS/json_c, bytes*ROUNDS/json_c/1e6);
+    printf("decode single pass: %10.1f entries/sec %8.1f MB/s\n",
+           count*ROUNDS/single_pass, bytes*ROUNDS/single_pass/1e6);
+    return 0;
+}
+
+int main()
+{
+    const char *filename = "./json-bench";
+    struct LocalLog *ll;
+    char *errmsg = NULL;
+    int rc;
+
+    remove_local_log(filename);
+    if ((rc = cql_open(filename, CLIENTID, ADDRESS, USER, PASSWORD, TOPIC, &ll)) != 0) {
+        return rc;
+    }
+    local_log_set_segment_size(ll, 1 << 30);
+    rc = cql_exec(ll, "CREATE TABLE readings (sensor INTEGER, value REAL, unit TEXT, note TEXT)",
+                  NULL, NULL, &errmsg);
+    const char *notes[] = { "ok", "door \"east\" open", "path/to/probe", "line\nbreak\ttab" };
+    for (size_t i = 0; i < ENTRIES - 1 && rc == 0; i++) {
+        int64_t sensor = (int64_t)(i % 64) - 8;
+        double value = (double)i/7;
+        const char *note = notes[i % 4];
+        struct Argument args[4] = {
+            { NULL, 0, &sensor, 0, Int },
+            { ":value", 6, &value, 0, Float },
+            { NULL, 0, "celsius", 7, String },
+            { NULL, 0, (void *)note, strlen(note), i % 5 == 0 ? Null : String },
+        };
+        rc = cql_exec_args(ll, "INSERT INTO readings (sensor, value, unit, note) VALUES (?, :value, ?, ?)",
+                           args, 4, NULL, NULL, &errmsg);
+    }
+    if (rc != 0) {
+        fprintf(stderr, "sql error: %s\n", errmsg);
+        sqlite3_free(errmsg);
+    } else {
+        rc = bench_encode(ll);
+    }
+    if (rc == 0) {
+        rc = bench_decode(ll);
+    }
+    local_log_free(ll);
+    remove_local_log(filename);
+    return rc;
+}
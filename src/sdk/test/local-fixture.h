@@ -0,0 +1,73 @@
+#ifndef COVENANTSQL_TEST_LOCAL_FIXTURE_H
+#define COVENANTSQL_TEST_LOCAL_FIXTURE_H
+
+#include "../base-enc.h"
+#include "../buffer.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Wall clock time, for throughput.
+static inline double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec/1e9;
+}
+
+// CPU time of the process, for costs that waiting on I/O would hide.
+static inline double cpu_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec/1e9;
+}
+
+// Delete the segment and its index for every sequence the manifest lists.
+static inline void remove_local_segments(const char *filename)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s-manifest", filename);
+    struct Buffer *buffer = malloc(sizeof(*buffer));
+    buffer_init(buffer);
+    buffer->fp = fopen(path, "rb");
+    if (buffer->fp == NULL) {
+        buffer_free(buffer);
+        return;
+    }
+
+    uint32_t magic, version, count;
+    if (decode_uint32(buffer, &magic) == 0 && decode_uint32(buffer, &version) == 0
+        && decode_uint32(buffer, &count) == 0) {
+        for (uint32_t i = 0; i < count; i++) {
+            uint64_t first_seq;
+            if (decode_uint64(buffer, &first_seq) != 0) {
+                break;
+            }
+            snprintf(path, sizeof(path), "%s-loc-%016" PRIx64, filename, first_seq);
+            unlink(path);
+            snprintf(path, sizeof(path), "%s-idx-%016" PRIx64, filename, first_seq);
+            unlink(path);
+        }
+    }
+    fclose(buffer->fp);
+    buffer_free(buffer);
+}
+
+// Remove the database and the local log opened with filename, so that a run starts empty.
+static inline void remove_local_log(const char *filename)
+{
+    remove_local_segments(filename);
+
+    const char *suffixes[] = { "", "-wal", "-shm", "-loc", "-manifest" };
+    char path[256];
+    for (size_t i = 0; i < sizeof(suffixes)/sizeof(suffixes[0]); i++) {
+        snprintf(path, sizeof(path), "%s%s", filename, suffixes[i]);
+        unlink(path);
+    }
+}
+
+#endif /* COVENANTSQL_TEST_LOCAL_FIXTURE_H */
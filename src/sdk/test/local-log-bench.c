@@ -0,0 +1,111 @@
+#include "config.h"
+#include "local-fixture.h"
+#include "../covenant-iot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define APPENDS 2000
+
+static int bench(struct LogEntry *log_entry, enum Durability durability, const char *name,
+                 size_t group_entries)
+{
+    const char *filename = "./local-bench";
+    remove_local_log(filename);
+
+    struct LocalLog *ll;
+    int rc = cql_open(filename, CLIENTID, ADDRESS, USER, PASSWORD, TOPIC, &ll);
+    if (rc != 0) {
+        return rc;
+    }
+    local_log_set_segment_size(ll, 1 << 30);
+    local_log_set_durability(ll, durability);
+    local_log_set_group_commit(ll, group_entries, 10);
+
+    double start = now_seconds();
+    for (int i = 0; i < APPENDS; i++) {
+        if ((rc = local_log_append(ll, log_entry)) != 0) {
+            local_log_free(ll);
+            return rc;
+        }
+    }
+    rc = local_log_sync(ll);
+    double elapsed = now_seconds() - start;
+    local_log_free(ll);
+    remove_local_log(filename);
+
+    printf("durability = %-9s group = %4zu: %10.0f appends/sec\n",
+           name, group_entries, APPENDS/elapsed);
+    return rc;
+}
+
+static int bench_read(struct LogEntry *log_entry)
+{
+    const char *filename = "./local-bench";
+    remove_local_log(filename);
+
+    struct LocalLog *ll;
+    int rc = cql_open(filename, CLIENTID, ADDRESS, USER, PASSWORD, TOPIC, &ll);
+    if (rc != 0) {
+        return rc;
+    }
+    local_log_set_segment_size(ll, 1 << 30);
+    local_log_set_durability(ll, DurabilityNone);
+    local_log_set_group_commit(ll, 128, 10);
+    for (int i = 0; i < APPENDS && rc == 0; i++) {
+        rc = local_log_append(ll, log_entry);
+    }
+    if (rc != 0 || (rc = local_log_sync(ll)) != 0) {
+        local_log_free(ll);
+        return rc;
+    }
+
+    struct LogCursor *cursor;
+    struct LogEntry *entry;
+    size_t count = 0;
+    double start = now_seconds();
+    if ((rc = local_log_cursor_open(ll, 0, &cursor)) != 0) {
+        local_log_free(ll);
+        return rc;
+    }
+    while ((rc = local_log_cursor_next(cursor, &entry)) == 0 && entry != NULL) {
+        count++;
+    }
+    local_log_cursor_close(cursor);
+    double elapsed = now_seconds() - start;
+    local_log_free(ll);
+    remove_local_log(filename);
+
+    printf("cursor read: %zu entries, %10.0f entries/sec\n", count, count/elapsed);
+    return rc;
+}
+
+int main()
+{
+    struct json_object *obj = json_object_from_file("./entries.json");
+    struct LogEntry *log_entry;
+    int rc = decode_log_entry_json(obj, &log_entry);
+    json_object_put(obj); // release object
+    if (rc != 0) {
+        return rc;
+    }
+
+    const size_t groups[] = { 1, 16, 128 };
+    for (size_t i = 0; i < sizeof(groups)/sizeof(groups[0]) && rc == 0; i++) {
+        if ((rc = bench(log_entry, DurabilityNone, "none", groups[i])) != 0
+            || (rc = bench(log_entry, DurabilityWrite, "write", groups[i])) != 0
+            || (rc = bench(log_entry, DurabilityFdatasync, "fdatasync", groups[i])) != 0) {
+            break;
+        }
+    }
+
+    if (rc == 0) {
+        rc = bench_read(log_entry);
+    }
+
+    log_entry_free(log_entry);
+    return rc;
+}
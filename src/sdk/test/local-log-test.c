@@ -1,8 +1,307 @@
 #include "config.h"
+#include "local-fixture.h"
 #include "../covenant-iot.h"
 
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Layout of the header file, as written by local.c: two slots, each starting with the magic, the
+// version and the generation, followed by the block, the watermarks and the sequence.
+#define HEADER_SLOT_SIZE        4096
+#define HEADER_GENERATION_AT    8
+#define HEADER_SEQUENCE_AT      40
+
+// Run a query that returns one integer.
+static int query_int64(struct LocalLog *const ll, const char *sql, int64_t *value)
+{
+    struct QueryCursor *cursor;
+    char *errmsg = NULL;
+    int rc = cql_query(ll, sql, NULL, 0, &cursor, &errmsg);
+    if (rc == 0) {
+        rc = cql_query_next(cursor, &errmsg);
+        if (rc == SQLITE_ROW) {
+            *value = cql_column_int64(cursor, 0);
+            rc = 0;
+        }
+        cql_query_close(cursor);
+    }
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", sql, errmsg != NULL ? errmsg : "no row");
+        sqlite3_free(errmsg);
+    }
+    return rc;
+}
+
+// Count the entries a cursor finds in the local log.
+static int count_log_entries(struct LocalLog *const ll, int64_t *count)
+{
+    struct LogCursor *cursor;
+    int rc = local_log_cursor_open(ll, 0, &cursor);
+    if (rc != 0) {
+        return rc;
+    }
+    struct LogEntry *entry;
+    *count = 0;
+    while ((rc = local_log_cursor_next(cursor, &entry)) == 0 && entry != NULL) {
+        (*count)++;
+    }
+    local_log_cursor_close(cursor);
+    return rc;
+}
+
+static int expect(const char *what, int64_t value, int64_t expected)
+{
+    if (value != expected) {
+        fprintf(stderr, "%s: got %" PRId64 ", expected %" PRId64 "\n", what, value, expected);
+        return 1;
+    }
+    return 0;
+}
+
+static int exec_sql(struct LocalLog *const ll, const char *sql)
+{
+    char *errmsg = NULL;
+    int rc = cql_exec(ll, sql, NULL, NULL, &errmsg);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", sql, errmsg != NULL ? errmsg : "failed");
+        sqlite3_free(errmsg);
+    }
+    return rc;
+}
+
+// Append to the log in a child that exits without closing it, the way a crash would leave it:
+// the header last written after the first insert, five inserts past it and nothing committed to
+// the database.
+static int append_and_crash(const char *filename)
+{
+    // Output buffered before the fork would be written again by the child
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        struct LocalLog *ll;
+        int rc = cql_open(filename, CLIENTID, ADDRESS, USER, PASSWORD, TOPIC, &ll);
+        if (rc != 0) {
+            _exit(1);
+        }
+        local_log_set_auto_commit(ll, 1000, 60000);
+        rc = exec_sql(ll, "CREATE TABLE recovery (v INTEGER)");
+        if (rc == 0) {
+            rc = exec_sql(ll, "INSERT INTO recovery (v) VALUES (1)");
+        }
+        local_log_set_header_interval(ll, 60000);
+        char sql[64];
+        for (int v = 2; v <= 6 && rc == 0; v++) {
+            snprintf(sql, sizeof(sql), "INSERT INTO recovery (v) VALUES (%d)", v);
+            rc = exec_sql(ll, sql);
+        }
+        fflush(stdout);
+        _exit(rc == 0 ? 0 : 1);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Break the checksum of the header slot with the higher generation, by setting the top bit of
+// its sequence: reading it anyway would put the end of the log far past the segments.
+static int corrupt_newer_slot(const char *filename)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s-loc", filename);
+    FILE *fp = fopen(path, "r+b");
+    if (fp == NULL) {
+        return -1;
+    }
+    uint64_t generations[2] = { 0, 0 };
+    unsigned char bytes[8];
+    for (int i = 0; i < 2; i++) {
+        if (fseek(fp, (long)i*HEADER_SLOT_SIZE + HEADER_GENERATION_AT, SEEK_SET) != 0
+            || fread(bytes, 1, sizeof(bytes), fp) != sizeof(bytes)) {
+            fclose(fp);
+            return -1;
+        }
+        for (size_t j = 0; j < sizeof(bytes); j++) {
+            generations[i] = generations[i] << 8 | bytes[j];
+        }
+    }
+    long at = (generations[1] > generations[0] ? HEADER_SLOT_SIZE : 0) + HEADER_SEQUENCE_AT;
+    int rc = -1;
+    if (fseek(fp, at, SEEK_SET) == 0 && fread(bytes, 1, 1, fp) == 1) {
+        bytes[0] ^= 0x80;
+        if (fseek(fp, at, SEEK_SET) == 0 && fwrite(bytes, 1, 1, fp) == 1) {
+            rc = 0;
+        }
+    }
+    return fclose(fp) == 0 ? rc : -1;
+}
+
+// Cut the last few bytes off the first segment, in the middle of its last entry.
+static int tear_last_entry(const char *filename)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s-loc-%016" PRIx64, filename, (uint64_t)0);
+    struct stat st;
+    if (stat(path, &st) != 0 || st.st_size < 4) {
+        return -1;
+    }
+    return truncate(path, st.st_size - 3);
+}
+
+// Reopen a log whose newer header slot is corrupt and whose active segment ends in a torn entry:
+// the older slot is used, the entries written after it are recovered up to the torn one, which
+// is cut off, and all of them are replayed into the database.
+static int test_recovery()
+{
+    const char *filename = "./local-test-recovery";
+    remove_local_log(filename);
+    int rc;
+    if ((rc = append_and_crash(filename)) != 0
+        || (rc = corrupt_newer_slot(filename)) != 0
+        || (rc = tear_last_entry(filename)) != 0) {
+        fprintf(stderr, "failed to set up a torn local log\n");
+        return rc;
+    }
+
+    struct LocalLog *ll;
+    rc = cql_open(filename, CLIENTID, ADDRESS, USER, PASSWORD, TOPIC, &ll);
+    if (rc != 0) {
+        return rc;
+    }
+    int64_t entries, rows, sum, next_apply;
+    if ((rc = count_log_entries(ll, &entries)) == 0
+        && (rc = query_int64(ll, "SELECT count(*) FROM recovery", &rows)) == 0
+        && (rc = query_int64(ll, "SELECT sum(v) FROM recovery", &sum)) == 0
+        && (rc = query_int64(ll, "SELECT value FROM __cql_local_meta WHERE key = 'next_apply'",
+                             &next_apply)) == 0) {
+        rc = expect("recovered entries", entries, 6)
+            + expect("recovered rows", rows, 5)
+            + expect("sum of recovered rows", sum, 15)
+            + expect("applied watermark", next_apply, 6);
+    }
+
+    // The next entry follows the recovered ones
+    if (rc == 0 && (rc = exec_sql(ll, "INSERT INTO recovery (v) VALUES (7)")) == 0
+        && (rc = count_log_entries(ll, &entries)) == 0
+        && (rc = query_int64(ll, "SELECT value FROM __cql_local_meta WHERE key = 'next_apply'",
+                             &next_apply)) == 0) {
+        rc = expect("entries after append", entries, 7) + expect("applied watermark", next_apply, 7);
+    }
+    local_log_free(ll);
+    remove_local_log(filename);
+    return rc;
+}
+
+static int check_reopened(struct LocalLog *const ll, int64_t entries, int64_t rows, int64_t sum)
+{
+    int64_t count, total, next_apply;
+    int rc;
+    if ((rc = count_log_entries(ll, &count)) != 0
+        || (rc = query_int64(ll, "SELECT count(*) FROM reopen", &total)) != 0
+        || (rc = expect("rows", total, rows)) != 0
+        || (rc = query_int64(ll, "SELECT sum(v) FROM reopen", &total)) != 0
+        || (rc = query_int64(ll, "SELECT value FROM __cql_local_meta WHERE key = 'next_apply'",
+                             &next_apply)) != 0) {
+        return rc;
+    }
+    return expect("entries", count, entries) + expect("sum of rows", total, sum)
+        + expect("applied watermark", next_apply, entries);
+}
+
+// Insert from..to in a child that commits every second statement and exits without closing the
+// log, leaving the last insert in the log but not in the database.
+static int insert_and_crash(const char *filename, int from, int to)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        struct LocalLog *ll;
+        int rc = cql_open(filename, CLIENTID, ADDRESS, USER, PASSWORD, TOPIC, &ll);
+        if (rc != 0) {
+            _exit(1);
+        }
+        local_log_set_auto_commit(ll, 2, 60000);
+        char sql[64];
+        for (int v = from; v <= to && rc == 0; v++) {
+            snprintf(sql, sizeof(sql), "INSERT INTO reopen (v) VALUES (%d)", v);
+            rc = exec_sql(ll, sql);
+        }
+        fflush(stdout);
+        _exit(rc == 0 ? 0 : 1);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Reopen replays only the entries at or past the applied watermark. The table has no key, so an
+// entry applied twice would show up as a duplicate row.
+static int test_reopen()
+{
+    const char *filename = "./local-test-reopen";
+    remove_local_log(filename);
+
+    struct LocalLog *ll;
+    int rc = cql_open(filename, CLIENTID, ADDRESS, USER, PASSWORD, TOPIC, &ll);
+    if (rc != 0) {
+        return rc;
+    }
+    rc = exec_sql(ll, "CREATE TABLE reopen (v INTEGER)");
+    char sql[64];
+    for (int v = 1; v <= 3 && rc == 0; v++) {
+        snprintf(sql, sizeof(sql), "INSERT INTO reopen (v) VALUES (%d)", v);
+        rc = exec_sql(ll, sql);
+    }
+    local_log_free(ll);
+    if (rc != 0) {
+        return rc;
+    }
+
+    // Everything was applied before closing, nothing is replayed
+    if ((rc = cql_open(filename, CLIENTID, ADDRESS, USER, PASSWORD, TOPIC, &ll)) != 0) {
+        return rc;
+    }
+    rc = check_reopened(ll, 4, 3, 6);
+    local_log_free(ll);
+    if (rc != 0) {
+        return rc;
+    }
+
+    // 4 and 5 are committed, 6 is only in the log and is replayed from the watermark
+    if ((rc = insert_and_crash(filename, 4, 6)) != 0) {
+        fprintf(stderr, "failed to leave an entry past the applied watermark\n");
+        return rc;
+    }
+    if ((rc = cql_open(filename, CLIENTID, ADDRESS, USER, PASSWORD, TOPIC, &ll)) != 0) {
+        return rc;
+    }
+    rc = check_reopened(ll, 7, 6, 21);
+    local_log_free(ll);
+    remove_local_log(filename);
+    return rc;
+}
+
 int main()
 {
+    // Start from an empty log, entries appended by an earlier run would be replayed and committed
+    // on open, and the fixed keys of entries.json only insert once.
+    remove_local_log("./local-test");
+
     struct json_object *obj = json_object_from_file("./entries.json");
     struct LogEntry *log_entry;
     int rc = decode_log_entry_json(obj, &log_entry);
@@ -33,6 +332,10 @@ int main()
     }
     local_log_free(ll);
     ll = NULL;
-    return 0;
+
+    if ((rc = test_reopen()) != 0) {
+        return rc;
+    }
+    return test_recovery();
 }
 
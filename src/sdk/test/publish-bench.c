@@ -0,0 +1,83 @@
+#include "config.h"
+#include "local-fixture.h"
+#include "../covenant-iot.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Publishes to the broker at ADDRESS. To see the effect of the window on a slow link, add delay
+// to the loopback interface while it runs, e.g. for a 300ms round trip:
+//   tc qdisc add dev lo root netem delay 150ms
+#define ENTRIES 200
+
+static int run(const char *filename, enum PayloadFormat format, size_t window, size_t envelope)
+{
+    struct LocalLog *ll;
+    char *errmsg = NULL;
+    int rc;
+
+    remove_local_log(filename);
+    if ((rc = cql_open(filename, CLIENTID, ADDRESS, USER, PASSWORD, TOPIC, &ll)) != 0) {
+        return rc;
+    }
+    local_log_set_segment_size(ll, 1 << 30);
+    rc = cql_exec(ll, "CREATE TABLE readings (sensor INTEGER, value REAL)", NULL, NULL, &errmsg);
+    for (size_t i = 0; i < ENTRIES - 1 && rc == 0; i++) {
+        int64_t sensor = (int64_t)(i % 64);
+        double value = (double)i/10;
+        struct Argument args[2] = {
+            { NULL, 0, &sensor, 0, Int },
+            { NULL, 0, &value, 0, Float },
+        };
+        rc = cql_exec_args(ll, "INSERT INTO readings (sensor, value) VALUES (?, ?)", args, 2,
+                           NULL, NULL, &errmsg);
+    }
+    if (rc != 0) {
+        fprintf(stderr, "sql error: %s\n", errmsg);
+        sqlite3_free(errmsg);
+        local_log_free(ll);
+        return rc;
+    }
+
+    local_log_set_publish_window(ll, window);
+    local_log_set_publish_envelope(ll, envelope, 0);
+    local_log_set_publish_format(ll, format);
+    double start = now_seconds();
+    clock_t cpu_start = clock();
+    rc = cql_publish(ll);
+    double cpu = (double)(clock() - cpu_start)/CLOCKS_PER_SEC;
+    double elapsed = now_seconds() - start;
+    uint64_t messages, bytes;
+    local_log_publish_stats(ll, &messages, &bytes);
+    local_log_free(ll);
+    remove_local_log(filename);
+    if (rc != 0) {
+        fprintf(stderr, "failed to publish, return code %d\n", rc);
+        return rc;
+    }
+    printf("%s, window %3zu, envelope %3zu: %10.1f messages/sec %10.1f entries/sec %8" PRIu64
+           " bytes %8.1f us cpu/entry\n", format == PayloadBinary ? "binary" : "json  ",
+           window, envelope, messages/elapsed, ENTRIES/elapsed, bytes, cpu*1e6/ENTRIES);
+    return 0;
+}
+
+int main()
+{
+    const char *filename = "./publish-bench";
+    size_t windows[] = { 1, 4, 16, 64 };
+    size_t envelopes[] = { 1, 16, 64 };
+    enum PayloadFormat formats[] = { PayloadJson, PayloadBinary };
+    int rc = 0;
+    for (size_t f = 0; f < sizeof(formats)/sizeof(formats[0]) && rc == 0; f++) {
+        for (size_t i = 0; i < sizeof(envelopes)/sizeof(envelopes[0]) && rc == 0; i++) {
+            for (size_t j = 0; j < sizeof(windows)/sizeof(windows[0]) && rc == 0; j++) {
+                rc = run(filename, formats[f], windows[j], envelopes[i]);
+            }
+        }
+    }
+    return rc;
+}
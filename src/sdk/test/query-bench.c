@@ -0,0 +1,109 @@
+#include "config.h"
+#include "local-fixture.h"
+#include "../covenant-iot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROWS 100000
+#define BATCH 1000
+#define ROUNDS 10
+
+struct Sum {
+    int64_t sensors;
+    double values;
+};
+
+static int sum_callback(void *arg, int columns, char **values, char **names)
+{
+    struct Sum *sum = arg;
+    sum->sensors += strtoll(values[0], NULL, 10);
+    sum->values += strtod(values[1], NULL);
+    return 0;
+}
+
+int main()
+{
+    const char *filename = "./query-bench";
+    struct LocalLog *ll;
+    char *errmsg = NULL;
+    int rc;
+
+    remove_local_log(filename);
+    if ((rc = cql_open(filename, CLIENTID, ADDRESS, USER, PASSWORD, TOPIC, &ll)) != 0) {
+        return rc;
+    }
+    local_log_set_segment_size(ll, 1 << 30);
+    rc = cql_exec(ll, "CREATE TABLE readings (sensor INTEGER, value REAL)", NULL, NULL, &errmsg);
+
+    static int64_t sensors[BATCH];
+    static double values[BATCH];
+    static struct Argument args[BATCH*2];
+    for (size_t i = 0; i < ROWS && rc == 0; i += BATCH) {
+        for (size_t j = 0; j < BATCH; j++) {
+            sensors[j] = (int64_t)((i + j) % 64);
+            values[j] = (double)(i + j)/10;
+            args[j*2] = (struct Argument){ NULL, 0, &sensors[j], 0, Int };
+            args[j*2 + 1] = (struct Argument){ NULL, 0, &values[j], 0, Float };
+        }
+        rc = cql_exec_batch(ll, "INSERT INTO readings (sensor, value) VALUES (?, ?)", args, 2, BATCH,
+                            &errmsg);
+    }
+    if (rc != 0) {
+        fprintf(stderr, "sql error: %s\n", errmsg);
+        sqlite3_free(errmsg);
+        local_log_free(ll);
+        return rc;
+    }
+
+    const char *query = "SELECT sensor, value FROM readings";
+
+    // Rows rendered as text for a sqlite3_exec style callback
+    struct Sum exec_sum = { 0, 0 };
+    double start = now_seconds();
+    for (int i = 0; i < ROUNDS && rc == 0; i++) {
+        rc = cql_exec(ll, query, sum_callback, &exec_sum, &errmsg);
+    }
+    double elapsed = now_seconds() - start;
+    if (rc != 0) {
+        fprintf(stderr, "sql error: %s\n", errmsg);
+        sqlite3_free(errmsg);
+        local_log_free(ll);
+        return rc;
+    }
+    printf("exec callback:  %10.0f rows/sec\n", ROWS*ROUNDS/elapsed);
+
+    // Typed columns read straight from the statement
+    struct Sum query_sum = { 0, 0 };
+    start = now_seconds();
+    for (int i = 0; i < ROUNDS && rc == 0; i++) {
+        struct QueryCursor *cursor;
+        if ((rc = cql_query(ll, query, NULL, 0, &cursor, &errmsg)) != 0) {
+            break;
+        }
+        while ((rc = cql_query_next(cursor, &errmsg)) == SQLITE_ROW) {
+            query_sum.sensors += cql_column_int64(cursor, 0);
+            query_sum.values += cql_column_double(cursor, 1);
+        }
+        cql_query_close(cursor);
+        rc = rc == SQLITE_DONE ? 0 : rc;
+    }
+    elapsed = now_seconds() - start;
+    local_log_free(ll);
+    remove_local_log(filename);
+    if (rc != 0) {
+        fprintf(stderr, "sql error: %s\n", errmsg);
+        sqlite3_free(errmsg);
+        return rc;
+    }
+    printf("typed query:    %10.0f rows/sec\n", ROWS*ROUNDS/elapsed);
+
+    if (exec_sum.sensors != query_sum.sensors) {
+        fprintf(stderr, "results differ\n");
+        return 1;
+    }
+    return 0;
+}
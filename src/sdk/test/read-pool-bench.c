@@ -0,0 +1,139 @@
+#include "config.h"
+#include "local-fixture.h"
+#include "../covenant-iot.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define READERS 4
+#define BATCH 100
+#define SECONDS 2.0
+
+struct Worker {
+    pthread_t thread;
+    struct LocalLog *ll;
+    double deadline;
+    int seed;
+    size_t done;
+    int rc;
+};
+
+// Insert batches of readings until the deadline
+static void *write_readings(void *arg)
+{
+    struct Worker *worker = arg;
+    char *errmsg = NULL;
+    int64_t sensors[BATCH];
+    double values[BATCH];
+    struct Argument args[BATCH*2];
+    while (worker->rc == 0 && now_seconds() < worker->deadline) {
+        for (size_t i = 0; i < BATCH; i++) {
+            sensors[i] = (int64_t)((worker->done + i) % 64);
+            values[i] = (double)(worker->done + i)/10;
+            args[i*2] = (struct Argument){ NULL, 0, &sensors[i], 0, Int };
+            args[i*2 + 1] = (struct Argument){ NULL, 0, &values[i], 0, Float };
+        }
+        worker->rc = cql_exec_batch(worker->ll, "INSERT INTO readings (sensor, value) VALUES (?, ?)",
+                                    args, 2, BATCH, &errmsg);
+        worker->done += BATCH;
+    }
+    if (worker->rc != 0) {
+        fprintf(stderr, "sql error: %s\n", errmsg);
+        sqlite3_free(errmsg);
+    }
+    return NULL;
+}
+
+// Aggregate the readings of one sensor after the other until the deadline
+static void *query_readings(void *arg)
+{
+    struct Worker *worker = arg;
+    char *errmsg = NULL;
+    int64_t sensor = worker->seed;
+    struct Argument args[1] = {{ NULL, 0, &sensor, 0, Int }};
+    while (worker->rc == 0 && now_seconds() < worker->deadline) {
+        struct QueryCursor *cursor;
+        sensor = (sensor + 1) % 64;
+        worker->rc = cql_query(worker->ll, "SELECT count(*), avg(value) FROM readings WHERE sensor = ?",
+                               args, 1, &cursor, &errmsg);
+        if (worker->rc != 0) {
+            break;
+        }
+        while ((worker->rc = cql_query_next(cursor, &errmsg)) == SQLITE_ROW) {
+        }
+        cql_query_close(cursor);
+        worker->rc = worker->rc == SQLITE_DONE ? 0 : worker->rc;
+        worker->done++;
+    }
+    if (worker->rc != 0) {
+        fprintf(stderr, "sql error: %s\n", errmsg);
+        sqlite3_free(errmsg);
+    }
+    return NULL;
+}
+
+static int run(struct LocalLog *ll, int writer, int readers)
+{
+    struct Worker workers[1 + READERS];
+    double start = now_seconds();
+    int rc = 0;
+    for (int i = 0; i < 1 + readers; i++) {
+        workers[i] = (struct Worker){ 0, ll, start + SECONDS, i*16, 0, 0 };
+        if (i == 0 && !writer) {
+            continue;
+        }
+        pthread_create(&workers[i].thread, NULL, i == 0 ? write_readings : query_readings, &workers[i]);
+    }
+    size_t queries = 0;
+    for (int i = 0; i < 1 + readers; i++) {
+        if (i == 0 && !writer) {
+            continue;
+        }
+        pthread_join(workers[i].thread, NULL);
+        rc = rc != 0 ? rc : workers[i].rc;
+        queries += i > 0 ? workers[i].done : 0;
+    }
+    double elapsed = now_seconds() - start;
+    printf("writer %d, readers %d: %10.0f rows/sec written %10.0f queries/sec\n",
+           writer, readers, workers[0].done/elapsed, queries/elapsed);
+    return rc;
+}
+
+int main()
+{
+    const char *filename = "./read-pool-bench";
+    struct LocalLog *ll;
+    char *errmsg = NULL;
+    int rc;
+
+    remove_local_log(filename);
+    if ((rc = cql_open(filename, CLIENTID, ADDRESS, USER, PASSWORD, TOPIC, &ll)) != 0) {
+        return rc;
+    }
+    local_log_set_segment_size(ll, 1 << 30);
+    if ((rc = cql_exec(ll, "CREATE TABLE readings (sensor INTEGER, value REAL);"
+                           "CREATE INDEX readings_sensor ON readings (sensor)",
+                       NULL, NULL, &errmsg)) != 0) {
+        fprintf(stderr, "sql error: %s\n", errmsg);
+        sqlite3_free(errmsg);
+        local_log_free(ll);
+        return rc;
+    }
+    if ((rc = local_log_open_read_pool(ll, READERS)) != 0) {
+        fprintf(stderr, "cannot open read pool\n");
+        local_log_free(ll);
+        return rc;
+    }
+
+    // Writes and queries on their own, then both at once
+    if ((rc = run(ll, 1, 0)) == 0 && (rc = run(ll, 0, 1)) == 0 && (rc = run(ll, 0, READERS)) == 0) {
+        rc = run(ll, 1, READERS);
+    }
+    local_log_free(ll);
+    remove_local_log(filename);
+    return rc;
+}
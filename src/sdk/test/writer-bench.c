@@ -0,0 +1,139 @@
+#include "config.h"
+#include "local-fixture.h"
+#include "../covenant-iot.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROWS 4000
+
+struct Producer {
+    pthread_t thread;
+    struct LocalLog *ll;
+    int64_t sensor;
+    size_t rows;
+    double latency;
+    int rc;
+};
+
+// Insert rows one statement at a time, as a sensor thread would
+static void *produce(void *arg)
+{
+    struct Producer *producer = arg;
+    char *errmsg = NULL;
+    for (size_t i = 0; i < producer->rows && producer->rc == 0; i++) {
+        double value = (double)i/10;
+        struct Argument args[2] = {
+            { NULL, 0, &producer->sensor, 0, Int },
+            { NULL, 0, &value, 0, Float },
+        };
+        double start = now_seconds();
+        producer->rc = cql_exec_args(producer->ll, "INSERT INTO readings (sensor, value) VALUES (?, ?)",
+                                     args, 2, NULL, NULL, &errmsg);
+        producer->latency += now_seconds() - start;
+    }
+    if (producer->rc != 0) {
+        fprintf(stderr, "sql error: %s\n", errmsg);
+        sqlite3_free(errmsg);
+    }
+    return NULL;
+}
+
+static void count_completed(void *arg, int rc, const char *errmsg)
+{
+    if (rc != 0) {
+        fprintf(stderr, "sql error: %s\n", errmsg);
+        (*(int *)arg)++;
+    }
+}
+
+// Insert rows without waiting for them, as a control loop would
+static void *produce_async(void *arg)
+{
+    struct Producer *producer = arg;
+    int failed = 0;
+    struct ExecTicket *ticket = NULL;
+    for (size_t i = 0; i < producer->rows && producer->rc == 0; i++) {
+        double value = (double)i/10;
+        struct Argument args[2] = {
+            { NULL, 0, &producer->sensor, 0, Int },
+            { NULL, 0, &value, 0, Float },
+        };
+        double start = now_seconds();
+        producer->rc = cql_exec_async(producer->ll, "INSERT INTO readings (sensor, value) VALUES (?, ?)",
+                                      args, 2, count_completed, &failed,
+                                      i == producer->rows - 1 ? &ticket : NULL);
+        producer->latency += now_seconds() - start;
+    }
+    // Entries of a thread complete in order, the last one is done when all of them are
+    if (producer->rc == 0) {
+        producer->rc = cql_ticket_wait(ticket, NULL);
+        cql_ticket_free(ticket);
+    }
+    producer->rc = producer->rc != 0 ? producer->rc : failed;
+    return NULL;
+}
+
+// Insert ROWS rows from the given number of threads, through the writer thread unless there is
+// only a single thread with no writer, and without waiting for each of them if async
+static int run(const char *filename, int writer, int async, int threads)
+{
+    struct LocalLog *ll;
+    char *errmsg = NULL;
+    int rc;
+
+    remove_local_log(filename);
+    if ((rc = cql_open(filename, CLIENTID, ADDRESS, USER, PASSWORD, TOPIC, &ll)) != 0) {
+        return rc;
+    }
+    local_log_set_segment_size(ll, 1 << 30);
+    local_log_set_durability(ll, DurabilityFdatasync);
+    if ((rc = cql_exec(ll, "CREATE TABLE readings (sensor INTEGER, value REAL)",
+                       NULL, NULL, &errmsg)) != 0) {
+        fprintf(stderr, "sql error: %s\n", errmsg);
+        sqlite3_free(errmsg);
+        local_log_free(ll);
+        return rc;
+    }
+    if (writer && (rc = local_log_start_writer(ll)) != 0) {
+        local_log_free(ll);
+        return rc;
+    }
+
+    struct Producer producers[threads];
+    double start = now_seconds();
+    for (int i = 0; i < threads; i++) {
+        producers[i] = (struct Producer){ 0, ll, i, ROWS/threads, 0, 0 };
+        pthread_create(&producers[i].thread, NULL, async ? produce_async : produce, &producers[i]);
+    }
+    double latency = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(producers[i].thread, NULL);
+        rc = rc != 0 ? rc : producers[i].rc;
+        latency += producers[i].latency;
+    }
+    double elapsed = now_seconds() - start;
+    local_log_free(ll);
+    remove_local_log(filename);
+    if (rc == 0) {
+        printf("writer %d, async %d, threads %2d: %10.0f rows/sec %10.1f us/statement\n",
+               writer, async, threads, ROWS/elapsed, latency/ROWS*1e6);
+    }
+    return rc;
+}
+
+int main()
+{
+    const char *filename = "./writer-bench";
+    int rc;
+    if ((rc = run(filename, 0, 0, 1)) == 0 && (rc = run(filename, 1, 0, 1)) == 0
+        && (rc = run(filename, 1, 0, 4)) == 0 && (rc = run(filename, 1, 0, 16)) == 0
+        && (rc = run(filename, 1, 1, 1)) == 0) {
+        rc = run(filename, 1, 1, 4);
+    }
+    return rc;
+}